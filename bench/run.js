@@ -0,0 +1,222 @@
+// Benchmarks the bindings against a synthetic corpus and prints JSON.
+//
+//   node bench/run.js [--docs 100000] [--queries 1000] [--seed 1] [--out file]
+//
+// The corpus is generated from a seeded PRNG with a Zipfian vocabulary, so
+// runs with the same arguments index and search identical data and their
+// results can be compared. Native timings come from MSet.stats and
+// xapian.metrics(); the rest of each wall-clock measurement is time spent
+// in JS and crossing N-API.
+const fs = require('fs');
+const os = require('os');
+const path = require('path');
+const xapian = require('..');
+
+function parseArgs(argv) {
+  const args = {docs: 100000, queries: 1000, seed: 1, vocab: 50000, out: null};
+  for (let i = 0; i < argv.length; i += 2) {
+    const key = argv[i].replace(/^--/, '');
+    if (!(key in args)) {
+      throw new Error(`unknown option ${argv[i]}`);
+    }
+    args[key] = key === 'out' ? argv[i + 1] : Number(argv[i + 1]);
+  }
+  return args;
+}
+
+// mulberry32
+function prng(seed) {
+  return () => {
+    seed = (seed + 0x6d2b79f5) | 0;
+    let t = Math.imul(seed ^ (seed >>> 15), 1 | seed);
+    t = (t + Math.imul(t ^ (t >>> 7), 61 | t)) ^ t;
+    return ((t ^ (t >>> 14)) >>> 0) / 4294967296;
+  };
+}
+
+// Draws word ranks with P(rank) proportional to 1 / rank.
+function zipf(random, n) {
+  const cdf = new Float64Array(n);
+  let sum = 0;
+  for (let i = 0; i < n; i++) {
+    sum += 1 / (i + 1);
+    cdf[i] = sum;
+  }
+  return () => {
+    const x = random() * sum;
+    let lo = 0;
+    let hi = n - 1;
+    while (lo < hi) {
+      const mid = (lo + hi) >>> 1;
+      if (cdf[mid] < x) {
+        lo = mid + 1;
+      } else {
+        hi = mid;
+      }
+    }
+    return lo;
+  };
+}
+
+function word(rank) {
+  const letters = 'etaoinshrdlucmfwypvbgkjqxz';
+  let w = '';
+  do {
+    w += letters[rank % 26];
+    rank = Math.floor(rank / 26);
+  } while (rank > 0);
+  return w;
+}
+
+function makeText(random, draw, minWords, maxWords) {
+  const n = minWords + Math.floor(random() * (maxWords - minWords + 1));
+  const words = new Array(n);
+  for (let i = 0; i < n; i++) {
+    words[i] = word(draw());
+  }
+  return words.join(' ');
+}
+
+function summarise(samples) {
+  const sorted = Float64Array.from(samples).sort();
+  const at = (q) => sorted[Math.min(sorted.length - 1, Math.floor(q * sorted.length))];
+  const total = sorted.reduce((a, b) => a + b, 0);
+  return {
+    count: sorted.length,
+    mean_ms: total / sorted.length,
+    p50_ms: at(0.5),
+    p90_ms: at(0.9),
+    p99_ms: at(0.99),
+    max_ms: sorted[sorted.length - 1],
+  };
+}
+
+function now() {
+  return Number(process.hrtime.bigint()) / 1e6;
+}
+
+function benchIndexing(dbPath, args, random, draw) {
+  const db = new xapian.WritableDatabase(dbPath, xapian.DB_CREATE_OR_OVERWRITE);
+  const tg = new xapian.TermGenerator();
+  tg.set_stemmer(new xapian.Stem('english'));
+  xapian.resetMetrics();
+  const start = now();
+  for (let i = 0; i < args.docs; i++) {
+    const doc = new xapian.Document();
+    const text = makeText(random, draw, 20, 200);
+    doc.set_data(text);
+    tg.set_document(doc);
+    tg.index_text(text);
+    db.add_document(doc);
+  }
+  const indexed = now();
+  db.commit();
+  const elapsed = now() - start;
+  const metrics = xapian.metrics();
+  db.close();
+  return {
+    docs: args.docs,
+    total_ms: elapsed,
+    build_ms: indexed - start,
+    commit_ms: metrics.commit.sum_ms,
+    docs_per_sec: args.docs / (elapsed / 1000),
+    add_document_native_ms: metrics.add_document.sum_ms,
+  };
+}
+
+function benchQueries(dbPath, args, random, draw) {
+  const db = new xapian.Database(dbPath);
+  const qp = new xapian.QueryParser();
+  qp.set_stemmer(new xapian.Stem('english'));
+  qp.set_database(db);
+  const enquire = new xapian.Enquire(db);
+  enquire.set_stats();
+
+  const wall = [];
+  const native = [];
+  const overhead = [];
+  const iterate = [];
+  const toArray = [];
+  const columns = [];
+  const snippets = [];
+  const stem = new xapian.Stem('english');
+  for (let i = 0; i < args.queries; i++) {
+    const text = makeText(random, draw, 1, 4);
+    const start = now();
+    const query = qp.parse_query(text);
+    enquire.set_query(query);
+    const mset = enquire.get_mset(0, 10);
+    const elapsed = now() - start;
+    const stats = mset.stats;
+    wall.push(elapsed);
+    native.push(stats.parse_ms + stats.match_ms);
+    overhead.push(elapsed - stats.parse_ms - stats.match_ms);
+
+    let t = now();
+    for (const it of mset) {
+      it.get_docid();
+      it.get_weight();
+    }
+    iterate.push(now() - t);
+
+    t = now();
+    mset.toArray();
+    toArray.push(now() - t);
+
+    t = now();
+    mset.columns();
+    columns.push(now() - t);
+
+    t = now();
+    for (const hit of mset.fetch({data: true})) {
+      mset.snippet(hit.data, 200, stem);
+    }
+    snippets.push(now() - t);
+  }
+  const metrics = xapian.metrics();
+  db.close();
+  return {
+    queries: args.queries,
+    search: summarise(wall),
+    search_native: summarise(native),
+    search_napi_overhead: summarise(overhead),
+    mset_iterate: summarise(iterate),
+    mset_to_array: summarise(toArray),
+    mset_columns: summarise(columns),
+    snippet_page: summarise(snippets),
+    native_metrics: {
+      get_mset: metrics.get_mset,
+      parse_query: metrics.parse_query,
+      snippet: metrics.snippet,
+    },
+  };
+}
+
+function main() {
+  const args = parseArgs(process.argv.slice(2));
+  const dir = fs.mkdtempSync(path.join(os.tmpdir(), 'xapian-bench-'));
+  try {
+    const random = prng(args.seed);
+    const draw = zipf(random, args.vocab);
+    const dbPath = path.join(dir, 'db');
+    const result = {
+      args,
+      node: process.version,
+      platform: `${os.platform()}-${os.arch()}`,
+      indexing: benchIndexing(dbPath, args, random, draw),
+    };
+    xapian.resetMetrics();
+    result.search = benchQueries(dbPath, args, random, draw);
+
+    const json = JSON.stringify(result, null, 2);
+    if (args.out) {
+      fs.writeFileSync(args.out, json + '\n');
+    } else {
+      console.log(json);
+    }
+  } finally {
+    fs.rmSync(dir, {recursive: true, force: true});
+  }
+}
+
+main();
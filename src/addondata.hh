@@ -0,0 +1,34 @@
+#pragma once
+
+#include <napi.h>
+
+#include <typeindex>
+#include <unordered_map>
+
+// Per-environment state of the addon. Every main thread and worker_thread
+// that loads the module gets its own AddonData, so class constructors are
+// never shared between isolates. It is freed when the environment exits.
+class AddonData {
+ public:
+  template <class T>
+  static void SetConstructor(Napi::Env env, Napi::Function func) {
+    Get(env)->constructors_[typeid(T)] = Napi::Persistent(func);
+  }
+
+  template <class T>
+  static Napi::FunctionReference& Constructor(Napi::Env env) {
+    return Get(env)->constructors_.at(typeid(T));
+  }
+
+ private:
+  static AddonData* Get(Napi::Env env) {
+    auto data = env.GetInstanceData<AddonData>();
+    if (data == nullptr) {
+      data = new AddonData();
+      env.SetInstanceData(data);
+    }
+    return data;
+  }
+
+  std::unordered_map<std::type_index, Napi::FunctionReference> constructors_;
+};
@@ -3,83 +3,121 @@
 #include <napi.h>
 #include <xapian.h>
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "addondata.hh"
 #include "document.hh"
 #include "exceptions.hh"
+#include "metrics.hh"
+#include "promiseworker.hh"
+#include "shareddatabase.hh"
 
 template <class T>
 class BaseDatabase {
  public:
   void close(const Napi::CallbackInfo& info) {
+    std::lock_guard<std::mutex> lock(*mutex_);
     TRY_CATCH_XAPIAN_CALLBACK_INFO(db_.close());
+    ++*generation_;
   }
 
   Napi::Value reopen(const Napi::CallbackInfo& info) {
-    return TRY_CATCH_XAPIAN_CALLBACK_INFO(
-        Napi::Boolean::New(info.Env(), db_.reopen()));
+    Metrics::Timer timer(Metrics::REOPEN);
+    std::lock_guard<std::mutex> lock(*mutex_);
+    bool changed = TRY_CATCH_XAPIAN_CALLBACK_INFO(db_.reopen());
+    if (changed) {
+      ++*generation_;
+    }
+    return Napi::Boolean::New(info.Env(), changed);
   }
 
   Napi::Value size(const Napi::CallbackInfo& info) {
+    std::lock_guard<std::mutex> lock(*mutex_);
     return TRY_CATCH_XAPIAN_CALLBACK_INFO(
         Napi::Number::New(info.Env(), db_.size()));
   }
 
   Napi::Value get_description(const Napi::CallbackInfo& info) {
+    std::lock_guard<std::mutex> lock(*mutex_);
     return TRY_CATCH_XAPIAN_CALLBACK_INFO(
         Napi::String::New(info.Env(), db_.get_description()));
   }
 
   Napi::Value has_positions(const Napi::CallbackInfo& info) {
+    std::lock_guard<std::mutex> lock(*mutex_);
     return TRY_CATCH_XAPIAN_CALLBACK_INFO(
         Napi::Boolean::New(info.Env(), db_.has_positions()));
   }
 
   Napi::Value get_doccount(const Napi::CallbackInfo& info) {
+    std::lock_guard<std::mutex> lock(*mutex_);
     return TRY_CATCH_XAPIAN_CALLBACK_INFO(
         Napi::Number::New(info.Env(), db_.get_doccount()));
   }
 
   Napi::Value get_lastdocid(const Napi::CallbackInfo& info) {
+    std::lock_guard<std::mutex> lock(*mutex_);
     return TRY_CATCH_XAPIAN_CALLBACK_INFO(
         Napi::Number::New(info.Env(), db_.get_lastdocid()));
   }
 
   Napi::Value get_avlength(const Napi::CallbackInfo& info) {
+    std::lock_guard<std::mutex> lock(*mutex_);
     return TRY_CATCH_XAPIAN_CALLBACK_INFO(
         Napi::Number::New(info.Env(), db_.get_avlength()));
   }
 
   Napi::Value get_total_length(const Napi::CallbackInfo& info) {
+    std::lock_guard<std::mutex> lock(*mutex_);
     return TRY_CATCH_XAPIAN_CALLBACK_INFO(
         Napi::Number::New(info.Env(), db_.get_total_length()));
   }
 
   Napi::Value get_doclength(const Napi::CallbackInfo& info) {
+    std::lock_guard<std::mutex> lock(*mutex_);
     return TRY_CATCH_XAPIAN_CALLBACK_INFO(
         Napi::Number::New(info.Env(), db_.get_doclength(info[0].ToNumber())));
   }
 
   Napi::Value get_document(const Napi::CallbackInfo& info) {
-    auto doc =
-        TRY_CATCH_XAPIAN_CALLBACK_INFO(db_.get_document(info[0].ToNumber()));
-    return Document::New(info.Env(), doc);
+    Xapian::docid docid = info[0].ToNumber();
+    Xapian::Document doc;
+    {
+      std::lock_guard<std::mutex> lock(*mutex_);
+      doc = TRY_CATCH_XAPIAN_CALLBACK_INFO(
+          Document::Detach(db_.get_document(docid)));
+    }
+    return Document::New(info.Env(), doc, docid);
   }
 
   Napi::Value get_metadata(const Napi::CallbackInfo& info) {
+    std::lock_guard<std::mutex> lock(*mutex_);
     return TRY_CATCH_XAPIAN_CALLBACK_INFO(
         Napi::String::New(info.Env(), db_.get_metadata(info[0].ToString())));
   }
 
   Napi::Value get_uuid(const Napi::CallbackInfo& info) {
+    std::lock_guard<std::mutex> lock(*mutex_);
     return TRY_CATCH_XAPIAN_CALLBACK_INFO(
         Napi::String::New(info.Env(), db_.get_uuid()));
   }
 
   Napi::Value locked(const Napi::CallbackInfo& info) {
+    std::lock_guard<std::mutex> lock(*mutex_);
     return TRY_CATCH_XAPIAN_CALLBACK_INFO(
         Napi::Boolean::New(info.Env(), db_.locked()));
   }
 
   Napi::Value get_revision(const Napi::CallbackInfo& info) {
+    std::lock_guard<std::mutex> lock(*mutex_);
     return TRY_CATCH_XAPIAN_CALLBACK_INFO(
         Napi::Number::New(info.Env(), db_.get_revision()));
   }
@@ -93,14 +131,197 @@ class BaseDatabase {
     if (info.Length() > 2) {
       block_size = info[2].ToNumber();
     }
+    std::lock_guard<std::mutex> lock(*mutex_);
     TRY_CATCH_XAPIAN_CALLBACK_INFO(
         db_.compact(info[0].ToString(), flags, block_size));
   }
 
+  Napi::Value reopen_async(const Napi::CallbackInfo& info) {
+    auto worker = new ReopenWorker(info.Env(), db_, mutex_, generation_);
+    worker->Queue();
+    return worker->Promise();
+  }
+
+  // Like compact(), on the threadpool, from a handle of its own so that
+  // nothing waits for it; a WritableDatabase is compacted as last committed.
+  // A function passed as the fourth argument is called with {table, status}
+  // as each table is compacted, until the promise settles.
+  Napi::Value compact_async(const Napi::CallbackInfo& info) {
+    uint32_t flags = 0;
+    int block_size = 0;
+    if (info.Length() > 1) {
+      flags = info[1].ToNumber();
+    }
+    if (info.Length() > 2) {
+      block_size = info[2].ToNumber();
+    }
+    if (shards_.empty()) {
+      throw Napi::Error::New(
+          info.Env(), "only databases opened from a path can be compacted");
+    }
+    auto worker = new CompactWorker(info.Env(), shards_, info[0].ToString(),
+                                    flags, block_size);
+    if (info[3].IsFunction()) {
+      worker->set_progress(info[3].As<Napi::Function>());
+    }
+    worker->Queue();
+    return worker->Promise();
+  }
+
   operator const T&() { return db_; }
 
+  // Serialises use of db_ between the main thread and threadpool workers;
+  // every method which touches db_ holds it.
+  std::shared_ptr<std::mutex> get_mutex() const { return mutex_; }
+
+  // Bumped whenever db_ may have moved to a new revision, so that results
+  // cached against the old one can be dropped.
+  std::shared_ptr<uint64_t> get_generation() const { return generation_; }
+
+  // The path and open flags of every shard, in docid interleaving order.
+  const std::vector<std::pair<std::string, int>>& shards() const {
+    return shards_;
+  }
+
+  // Opens `shards` as one database. Threadpool work uses this to get a
+  // handle of its own, as Xapian objects can't be shared between threads.
+  static Xapian::Database OpenShards(
+      const std::vector<std::pair<std::string, int>>& shards) {
+    Xapian::Database db;
+    for (auto& shard : shards) {
+      db.add_database(Xapian::Database(shard.first, shard.second));
+    }
+    return db;
+  }
+
  protected:
   T db_;
+  // Empty for an in-memory database.
+  std::vector<std::pair<std::string, int>> shards_;
+  std::shared_ptr<std::mutex> mutex_ = std::make_shared<std::mutex>();
+  std::shared_ptr<uint64_t> generation_ = std::make_shared<uint64_t>(0);
+
+ private:
+  class ReopenWorker : public PromiseWorker {
+   public:
+    ReopenWorker(Napi::Env env, T db, std::shared_ptr<std::mutex> mutex,
+                 std::shared_ptr<uint64_t> generation)
+        : PromiseWorker(env), db_(db), mutex_(mutex), generation_(generation) {}
+
+   protected:
+    void Run() override {
+      Metrics::Timer timer(Metrics::REOPEN);
+      std::lock_guard<std::mutex> lock(*mutex_);
+      changed_ = db_.reopen();
+    }
+
+    Napi::Value Result(Napi::Env env) override {
+      if (changed_) {
+        ++*generation_;
+      }
+      return Napi::Boolean::New(env, changed_);
+    }
+
+   private:
+    T db_;
+    std::shared_ptr<std::mutex> mutex_;
+    std::shared_ptr<uint64_t> generation_;
+    bool changed_ = false;
+  };
+
+  // Forwards Xapian's per-table status messages to a JS callback. Messages
+  // still queued once `settled` is set are dropped.
+  class ProgressCompactor : public Xapian::Compactor {
+   public:
+    ProgressCompactor(Napi::ThreadSafeFunction* progress,
+                      std::shared_ptr<bool> settled)
+        : progress_(progress), settled_(std::move(settled)) {}
+
+    void set_status(const std::string& table,
+                    const std::string& status) override {
+      if (progress_ == nullptr) {
+        return;
+      }
+      progress_->BlockingCall(new Event{table, status, settled_},
+                              CallProgress);
+    }
+
+   private:
+    struct Event {
+      std::string table;
+      std::string status;
+      std::shared_ptr<bool> settled;
+    };
+
+    static void CallProgress(Napi::Env env, Napi::Function callback,
+                             Event* event) {
+      std::unique_ptr<Event> owned(event);
+      if (env == nullptr || *event->settled) {
+        return;
+      }
+      auto obj = Napi::Object::New(env);
+      obj.Set("table", event->table);
+      obj.Set("status", event->status);
+      callback.Call({obj});
+    }
+
+    Napi::ThreadSafeFunction* progress_;
+    std::shared_ptr<bool> settled_;
+  };
+
+  // Compacts a handle opened on the worker thread, so it takes no lock and
+  // the database stays usable meanwhile.
+  class CompactWorker : public PromiseWorker {
+   public:
+    CompactWorker(Napi::Env env,
+                  std::vector<std::pair<std::string, int>> shards,
+                  std::string path, uint32_t flags, int block_size)
+        : PromiseWorker(env),
+          shards_(std::move(shards)),
+          path_(std::move(path)),
+          flags_(flags),
+          block_size_(block_size) {}
+
+    ~CompactWorker() { ReleaseProgress(); }
+
+    void set_progress(Napi::Function callback) {
+      progress_ = Napi::ThreadSafeFunction::New(
+          Env(), callback, "xapian compact progress", 0, 1);
+      has_progress_ = true;
+    }
+
+   protected:
+    void Run() override {
+      ProgressCompactor compactor(has_progress_ ? &progress_ : nullptr,
+                                  settled_);
+      OpenShards(shards_).compact(path_, flags_, block_size_, compactor);
+    }
+
+    Napi::Value Result(Napi::Env env) override { return env.Undefined(); }
+
+    // No progress is reported once the promise has settled.
+    void Cleanup(Napi::Env env) override {
+      *settled_ = true;
+      ReleaseProgress();
+    }
+
+   private:
+    void ReleaseProgress() {
+      if (has_progress_) {
+        progress_.Release();
+        has_progress_ = false;
+      }
+    }
+
+    const std::vector<std::pair<std::string, int>> shards_;
+    std::string path_;
+    uint32_t flags_;
+    int block_size_;
+    Napi::ThreadSafeFunction progress_;
+    bool has_progress_ = false;
+    // Only touched on the main thread.
+    std::shared_ptr<bool> settled_ = std::make_shared<bool>(false);
+  };
 };
 
 class Database : public Napi::ObjectWrap<Database>,
@@ -114,8 +335,9 @@ class Database : public Napi::ObjectWrap<Database>,
     if (info.Length() == 0) {
       db_ = TRY_CATCH_XAPIAN_CALLBACK_INFO(Xapian::Database());
     } else {
-      if (!info[0].IsString()) {
-        throw Napi::Error::New(env, "first argument must be database path");
+      if (!info[0].IsString() && !info[0].IsArray()) {
+        throw Napi::Error::New(
+            env, "first argument must be a database path or array of paths");
       }
 
       int flags = 0;
@@ -127,11 +349,124 @@ class Database : public Napi::ObjectWrap<Database>,
         flags = info[1].ToNumber();
       }
 
-      db_ = TRY_CATCH_XAPIAN_CALLBACK_INFO(
-          Xapian::Database(info[0].ToString(), flags));
+      if (info[0].IsString()) {
+        AddShard(env, info[0].ToString(), flags);
+      } else {
+        // Each path becomes a shard of one logical database.
+        auto arr = info[0].As<Napi::Array>();
+        for (uint32_t i = 0; i < arr.Length(); i++) {
+          AddShard(env, arr.Get(i).ToString(), flags);
+        }
+      }
+    }
+  }
+
+  // Adds the shards of another Database, or the database at a path. The
+  // other database's shards are opened again here, so the two handles stay
+  // independent and each keeps its own lock.
+  void add_database(const Napi::CallbackInfo& info) {
+    auto env = info.Env();
+    std::vector<std::pair<std::string, int>> shards;
+    if (info[0].IsString()) {
+      int flags = 0;
+      if (info.Length() > 1) {
+        flags = info[1].ToNumber();
+      }
+      shards.emplace_back(info[0].ToString(), flags);
+    } else if (info[0].IsObject() &&
+               info[0].As<Napi::Object>().InstanceOf(
+                   AddonData::Constructor<Database>(env).Value())) {
+      shards = Unwrap(info[0].As<Napi::Object>())->shards_;
+      if (shards.empty()) {
+        throw Napi::Error::New(
+            env, "only databases opened from a path can be added");
+      }
+    } else {
+      throw Napi::Error::New(
+          env, "first argument must be a Database or a database path");
+    }
+
+    // Open everything first so a bad path leaves this database unchanged.
+    std::vector<Xapian::Database> opened;
+    for (auto& shard : shards) {
+      opened.push_back(
+          TRY_CATCH_XAPIAN(env, Xapian::Database(shard.first, shard.second)));
+    }
+    std::lock_guard<std::mutex> lock(*mutex_);
+    for (size_t i = 0; i < opened.size(); i++) {
+      TRY_CATCH_XAPIAN(env, db_.add_database(opened[i]));
+      shards_.push_back(shards[i]);
+      parts_.push_back(opened[i]);
     }
+    ++*generation_;
+    readers_.reset();
+  }
+
+  // Returns a handle for SharedDatabase, which opens this database's shards
+  // again for all threads of the process, at most {maxReaders} times. The
+  // handle stays valid while this Database or any SharedDatabase attached to
+  // it is alive.
+  Napi::Value share(const Napi::CallbackInfo& info) {
+    auto env = info.Env();
+    if (!shared_) {
+      if (shards_.empty()) {
+        throw Napi::Error::New(
+            env, "only databases opened from a path can be shared");
+      }
+      shared_ = SharedDatabase::Open(
+          env, shards_, SharedDatabase::MaxReaders(info[0]), shared_id_);
+    }
+    return Napi::Number::New(env, shared_id_);
+  }
+
+  // Readers which get_mset_async() leases on the threadpool, opened again
+  // from the shards and reopened once this database has been, so matching
+  // doesn't open every shard per query.
+  std::shared_ptr<SharedDatabase::Handle> readers(Napi::Env env) {
+    if (!readers_) {
+      readers_ = TRY_CATCH_XAPIAN(
+          env, std::make_shared<SharedDatabase::Handle>(
+                   shards_, SharedDatabase::kDefaultReaders));
+    } else if (readers_generation_ != *generation_) {
+      readers_->Stale();
+    }
+    readers_generation_ = *generation_;
+    return readers_;
+  }
+
+  // The revision this database is at, see SharedDatabase::Handle::Revision.
+  // Called with the mutex held.
+  std::string revision() const {
+    return SharedDatabase::Handle::Revision(parts_);
   }
 
+  // Polls every shard from a background thread, using private handles, and
+  // reopens this database between calls on the main thread once any shard
+  // has a new revision. `callback` then gets the new revision, or undefined
+  // for a multi-shard database.
+  void watch(const Napi::CallbackInfo& info) {
+    auto env = info.Env();
+    if (!info[0].IsFunction()) {
+      throw Napi::Error::New(env, "first argument must be a callback");
+    }
+    if (shards_.empty()) {
+      throw Napi::Error::New(
+          env, "only databases opened from a path can be watched");
+    }
+    uint32_t interval = 1000;
+    if (info[1].IsObject() && info[1].As<Napi::Object>().Has("interval")) {
+      interval = info[1].As<Napi::Object>().Get("interval").ToNumber();
+    }
+    watcher_.reset();
+    auto tsfn = Napi::ThreadSafeFunction::New(
+        env, info[0].As<Napi::Function>(), "xapian database watcher", 0, 1);
+    // The watcher alone doesn't keep the process alive.
+    tsfn.Unref(env);
+    watcher_ = std::make_unique<Watcher>(shards_, interval, tsfn, this);
+  }
+
+  void unwatch(const Napi::CallbackInfo& info) { watcher_.reset(); }
+
   static void Init(Napi::Env env, Napi::Object exports) {
     Napi::HandleScope scope(env);
     Napi::Function func = DefineClass(
@@ -159,13 +494,117 @@ class Database : public Napi::ObjectWrap<Database>,
             InstanceMethod("locked", &Database::locked),
             InstanceMethod("get_revision", &Database::get_revision),
             InstanceMethod("compact", &Database::compact),
+            InstanceMethod("reopen_async", &Database::reopen_async),
+            InstanceMethod("compact_async", &Database::compact_async),
+            InstanceMethod("add_database", &Database::add_database),
+            InstanceMethod("share", &Database::share),
+            InstanceMethod("watch", &Database::watch),
+            InstanceMethod("unwatch", &Database::unwatch),
         });
-    constructor = Napi::Persistent(func);
-    constructor.SuppressDestruct();
+    AddonData::SetConstructor<Database>(env, func);
     exports.Set("Database", func);
   }
 
  private:
-  inline static Napi::FunctionReference constructor;
+  void AddShard(Napi::Env env, const std::string& path, int flags) {
+    auto shard = TRY_CATCH_XAPIAN(env, Xapian::Database(path, flags));
+    TRY_CATCH_XAPIAN(env, db_.add_database(shard));
+    shards_.emplace_back(path, flags);
+    parts_.push_back(shard);
+  }
+
+  class Watcher {
+   public:
+    Watcher(std::vector<std::pair<std::string, int>> shards,
+            uint32_t interval, Napi::ThreadSafeFunction tsfn, Database* db)
+        : shards_(std::move(shards)),
+          interval_(interval),
+          tsfn_(tsfn),
+          db_(db),
+          thread_(&Watcher::Run, this) {}
+
+    ~Watcher() {
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+      }
+      cond_.notify_all();
+      thread_.join();
+      // Calls still queued are dropped, see Notify().
+      tsfn_.Abort();
+    }
+
+    void Reopened() { pending_ = false; }
+
+   private:
+    void Run() {
+      // Only ever used on this thread.
+      std::vector<Xapian::Database> handles;
+      std::unique_lock<std::mutex> lock(mutex_);
+      while (!cond_.wait_for(lock, interval_, [this] { return stop_; })) {
+        try {
+          if (handles.empty()) {
+            for (auto& shard : shards_) {
+              handles.emplace_back(shard.first, shard.second);
+            }
+          }
+          for (auto& handle : handles) {
+            if (handle.reopen()) {
+              pending_ = true;
+            }
+          }
+        } catch (Xapian::Error&) {
+          // Missing or mid-replacement; open afresh on the next poll.
+          handles.clear();
+        }
+        if (pending_) {
+          tsfn_.NonBlockingCall(db_, Notify);
+        }
+      }
+    }
+
+    const std::vector<std::pair<std::string, int>> shards_;
+    const std::chrono::milliseconds interval_;
+    Napi::ThreadSafeFunction tsfn_;
+    Database* db_;
+    std::mutex mutex_;
+    std::condition_variable cond_;
+    bool stop_ = false;
+    std::atomic<bool> pending_{false};
+    std::thread thread_;
+  };
+
+  // Runs on the main thread. The reopen is skipped while async work holds
+  // the database, and retried after the next poll.
+  static void Notify(Napi::Env env, Napi::Function callback, Database* db) {
+    if (env == nullptr || !db->watcher_ || !db->mutex_->try_lock()) {
+      return;
+    }
+    bool changed = false;
+    Napi::Value revision = env.Undefined();
+    try {
+      changed = db->db_.reopen();
+      if (db->db_.size() == 1) {
+        revision = Napi::Number::New(env, db->db_.get_revision());
+      }
+    } catch (Xapian::Error&) {
+    }
+    db->mutex_->unlock();
+    db->watcher_->Reopened();
+    if (changed) {
+      ++*db->generation_;
+      callback.Call({revision});
+    }
+  }
+
+  std::shared_ptr<SharedDatabase::Handle> shared_;
+  uint32_t shared_id_ = 0;
+  std::shared_ptr<SharedDatabase::Handle> readers_;
+  uint64_t readers_generation_ = 0;
+  // Each shard of db_ on its own, sharing its state, as Xapian only reports
+  // the revision of a single database.
+  std::vector<Xapian::Database> parts_;
+  // Declared last so the thread is stopped before anything else goes.
+  std::unique_ptr<Watcher> watcher_;
 };
 
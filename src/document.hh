@@ -3,6 +3,10 @@
 #include <napi.h>
 #include <xapian.h>
 
+#include <string>
+#include <utility>
+
+#include "addondata.hh"
 #include "exceptions.hh"
 #include "termiterator.hh"
 
@@ -18,9 +22,56 @@ class Document : public Napi::ObjectWrap<Document> {
     }
   }
 
-  static Napi::Object New(Napi::Env env, Xapian::Document doc) {
+  // `docid` is reported by get_docid() for a document read with Detach(),
+  // which loses it.
+  static Napi::Object New(Napi::Env env, Xapian::Document doc,
+                          Xapian::docid docid = 0) {
     auto external = Napi::External<decltype(doc)>::New(env, &doc);
-    return constructor.New({external});
+    auto obj = AddonData::Constructor<Document>(env).New({external});
+    Unwrap(obj)->docid_ = docid;
+    return obj;
+  }
+
+  // Reads all of a document from its database. Xapian loads documents
+  // lazily through the handle they came from, so the copy is what lets JS
+  // use it without that handle's lock.
+  static Xapian::Document Detach(const Xapian::Document& doc) {
+    return Xapian::Document::unserialise(doc.serialise());
+  }
+
+  // Returns a Buffer that takes ownership of `str` instead of copying it.
+  static Napi::Buffer<char> ToBuffer(Napi::Env env, std::string&& str) {
+    auto owned = new std::string(std::move(str));
+    return Napi::Buffer<char>::New(
+        env, &(*owned)[0], owned->size(),
+        [](Napi::Env, char*, std::string* hint) { delete hint; }, owned);
+  }
+
+  // Reads a Buffer, ArrayBuffer, typed array or DataView byte for byte, and
+  // anything else as the UTF-8 of its toString().
+  static std::string ToBytes(const Napi::Value& value) {
+    if (value.IsBuffer()) {
+      auto buf = value.As<Napi::Buffer<char>>();
+      return std::string(buf.Data(), buf.Length());
+    }
+    if (value.IsArrayBuffer()) {
+      auto buf = value.As<Napi::ArrayBuffer>();
+      return std::string(static_cast<const char*>(buf.Data()),
+                         buf.ByteLength());
+    }
+    if (value.IsTypedArray()) {
+      auto arr = value.As<Napi::TypedArray>();
+      return std::string(
+          static_cast<const char*>(arr.ArrayBuffer().Data()) + arr.ByteOffset(),
+          arr.ByteLength());
+    }
+    if (value.IsDataView()) {
+      auto view = value.As<Napi::DataView>();
+      return std::string(static_cast<const char*>(view.ArrayBuffer().Data()) +
+                             view.ByteOffset(),
+                         view.ByteLength());
+    }
+    return value.ToString();
   }
 
   Napi::Value get_value(const Napi::CallbackInfo& info) {
@@ -28,9 +79,14 @@ class Document : public Napi::ObjectWrap<Document> {
         info.Env(), doc_.get_value(info[0].ToNumber().Int64Value())));
   }
 
+  Napi::Value get_value_buffer(const Napi::CallbackInfo& info) {
+    return ToBuffer(info.Env(), TRY_CATCH_XAPIAN_CALLBACK_INFO(doc_.get_value(
+                                    info[0].ToNumber().Int64Value())));
+  }
+
   void add_value(const Napi::CallbackInfo& info) {
     TRY_CATCH_XAPIAN_CALLBACK_INFO(
-        doc_.add_value(info[0].ToNumber().Int64Value(), info[1].ToString()));
+        doc_.add_value(info[0].ToNumber().Int64Value(), ToBytes(info[1])));
   }
 
   void remove_value(const Napi::CallbackInfo& info) {
@@ -47,13 +103,18 @@ class Document : public Napi::ObjectWrap<Document> {
         Napi::String::New(info.Env(), doc_.get_data()));
   }
 
+  Napi::Value get_data_buffer(const Napi::CallbackInfo& info) {
+    return ToBuffer(info.Env(),
+                    TRY_CATCH_XAPIAN_CALLBACK_INFO(doc_.get_data()));
+  }
+
   void set_data(const Napi::CallbackInfo& info) {
-    TRY_CATCH_XAPIAN_CALLBACK_INFO(doc_.set_data(info[0].ToString()));
+    TRY_CATCH_XAPIAN_CALLBACK_INFO(doc_.set_data(ToBytes(info[0])));
   }
 
   void set_data_setter(const Napi::CallbackInfo& info,
                        const Napi::Value& value) {
-    TRY_CATCH_XAPIAN_CALLBACK_INFO(doc_.set_data(value.ToString()));
+    TRY_CATCH_XAPIAN_CALLBACK_INFO(doc_.set_data(ToBytes(value)));
   }
 
   void add_posting(const Napi::CallbackInfo& info) {
@@ -124,6 +185,9 @@ class Document : public Napi::ObjectWrap<Document> {
   }
 
   Napi::Value get_docid(const Napi::CallbackInfo& info) {
+    if (docid_ != 0) {
+      return Napi::Number::New(info.Env(), docid_);
+    }
     return TRY_CATCH_XAPIAN_CALLBACK_INFO(
         Napi::Number::New(info.Env(), doc_.get_docid()));
   }
@@ -144,10 +208,12 @@ class Document : public Napi::ObjectWrap<Document> {
         env, "Document",
         {
             InstanceMethod("get_value", &Document::get_value),
+            InstanceMethod("get_value_buffer", &Document::get_value_buffer),
             InstanceMethod("add_value", &Document::add_value),
             InstanceMethod("remove_value", &Document::remove_value),
             InstanceMethod("clear_values", &Document::clear_values),
             InstanceMethod("get_data", &Document::get_data),
+            InstanceMethod("get_data_buffer", &Document::get_data_buffer),
             InstanceAccessor("data", &Document::get_data,
                              &Document::set_data_setter),
             InstanceMethod("set_data", &Document::set_data),
@@ -167,14 +233,13 @@ class Document : public Napi::ObjectWrap<Document> {
             InstanceMethod("get_description", &Document::get_description),
             InstanceMethod("toString", &Document::get_description),
         });
-    constructor = Napi::Persistent(func);
-    constructor.SuppressDestruct();
+    AddonData::SetConstructor<Document>(env, func);
     exports.Set("Document", func);
   }
 
   operator const Xapian::Document&() { return doc_; }
 
  private:
-  inline static Napi::FunctionReference constructor;
   Xapian::Document doc_;
+  Xapian::docid docid_ = 0;
 };
@@ -3,10 +3,27 @@
 #include <napi.h>
 #include <xapian.h>
 
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "addondata.hh"
 #include "database.hh"
 #include "exceptions.hh"
+#include "lockedmset.hh"
+#include "lrucache.hh"
+#include "matchspy.hh"
+#include "metrics.hh"
 #include "mset.hh"
+#include "promiseworker.hh"
 #include "query.hh"
+#include "shareddatabase.hh"
+#include "stats.hh"
 
 class Enquire : public Napi::ObjectWrap<Enquire> {
  public:
@@ -20,6 +37,11 @@ class Enquire : public Napi::ObjectWrap<Enquire> {
     }
     auto obj = info[0].As<Napi::Object>();
     auto db = Napi::ObjectWrap<Database>::Unwrap(obj);
+    database_ = Napi::Persistent(obj);
+    db_mutex_ = db->get_mutex();
+    db_generation_ = db->get_generation();
+    synced_generation_ = *db_generation_;
+    std::lock_guard<std::mutex> lock(*db_mutex_);
     enquire_ =
         TRY_CATCH_XAPIAN_CALLBACK_INFO(std::make_shared<Xapian::Enquire>(*db));
   }
@@ -28,28 +50,214 @@ class Enquire : public Napi::ObjectWrap<Enquire> {
     auto obj = info[0].As<Napi::Object>();
     Query* q = Napi::ObjectWrap<Query>::Unwrap(obj);
     TRY_CATCH_XAPIAN_CALLBACK_INFO(enquire_->set_query(*q));
+    settings_.query = *q;
+    parse_ms_ = q->parse_ms();
+  }
+
+  // set_weighting_scheme(name, params = {}), where name is one of
+  // BM25Weight, BM25PlusWeight, TfIdfWeight, BoolWeight or CoordWeight.
+  void set_weighting_scheme(const Napi::CallbackInfo& info) {
+    auto weight = NewWeight(info.Env(), info[0], info[1]);
+    TRY_CATCH_XAPIAN_CALLBACK_INFO(enquire_->set_weighting_scheme(*weight));
+    settings_.weight = std::move(weight);
+  }
+
+  // set_stats(enabled = true) attaches timings and term statistics to each
+  // MSet as MSet.stats.
+  void set_stats(const Napi::CallbackInfo& info) {
+    stats_ = info.Length() == 0 || info[0].ToBoolean();
   }
 
   void set_docid_order(const Napi::CallbackInfo& info) {
-    TRY_CATCH_XAPIAN_CALLBACK_INFO(
-        enquire_->set_docid_order(static_cast<Xapian::Enquire::docid_order>(
-            info[0].ToNumber().Int32Value())));
+    auto order = static_cast<Xapian::Enquire::docid_order>(
+        info[0].ToNumber().Int32Value());
+    TRY_CATCH_XAPIAN_CALLBACK_INFO(enquire_->set_docid_order(order));
+    settings_.docid_order = order;
+  }
+
+  // set_collapse_key(slot, max = 1); pass BAD_VALUENO to turn off collapsing.
+  void set_collapse_key(const Napi::CallbackInfo& info) {
+    Xapian::valueno slot = info[0].ToNumber();
+    Xapian::doccount max = 1;
+    if (info.Length() > 1) {
+      max = info[1].ToNumber();
+    }
+    TRY_CATCH_XAPIAN_CALLBACK_INFO(enquire_->set_collapse_key(slot, max));
+    settings_.collapse_key = slot;
+    settings_.collapse_max = max;
+  }
+
+  // Spies see every document the matcher considers, so pass a large enough
+  // checkatleast to get_mset for exact counts. Each match counts with spies
+  // of its own, returned by MSet.get_facets(); the spy added here shows the
+  // counts of the latest match to complete.
+  void add_matchspy(const Napi::CallbackInfo& info) {
+    auto obj = info[0].As<Napi::Object>();
+    auto spy = Napi::ObjectWrap<ValueCountMatchSpy>::Unwrap(obj);
+    settings_.facets.push_back(spy->slot());
+    matchspies_.push_back(Napi::Persistent(obj));
+  }
+
+  void clear_matchspies(const Napi::CallbackInfo& info) {
+    settings_.facets.clear();
+    matchspies_.clear();
+  }
+
+  // A match which runs for longer than `seconds` stops early and returns the
+  // best hits found so far, with MSet.truncated set. 0 means no limit.
+  void set_time_limit(const Napi::CallbackInfo& info) {
+    double time_limit = info[0].ToNumber().DoubleValue();
+    TRY_CATCH_XAPIAN_CALLBACK_INFO(enquire_->set_time_limit(time_limit));
+    settings_.time_limit = time_limit;
   }
 
   void set_sort_by_relevance(const Napi::CallbackInfo& info) {
-    enquire_->set_sort_by_relevance();
+    set_sort(info, Settings::SORT_RELEVANCE);
+  }
+
+  void set_sort_by_value(const Napi::CallbackInfo& info) {
+    set_sort(info, Settings::SORT_VALUE);
+  }
+
+  void set_sort_by_value_then_relevance(const Napi::CallbackInfo& info) {
+    set_sort(info, Settings::SORT_VALUE_THEN_RELEVANCE);
+  }
+
+  void set_sort_by_relevance_then_value(const Napi::CallbackInfo& info) {
+    set_sort(info, Settings::SORT_RELEVANCE_THEN_VALUE);
+  }
+
+  // set_sort_by_key(keys: {slot, reverse = false}[], reverse = false)
+  void set_sort_by_key(const Napi::CallbackInfo& info) {
+    set_sort(info, Settings::SORT_KEY);
   }
 
   Napi::Value get_mset(const Napi::CallbackInfo& info) {
-    uint64_t checkatleast = 0;
+    Xapian::doccount first = info[0].ToNumber();
+    Xapian::doccount maxitems = info[1].ToNumber();
+    Xapian::doccount checkatleast = 0;
     if (info.Length() > 2) {
-      checkatleast = static_cast<uint64_t>(info[2].ToNumber().Int64Value());
+      checkatleast = info[2].ToNumber();
     }
-    return MSet::New(
-        info.Env(), TRY_CATCH_XAPIAN_CALLBACK_INFO(enquire_->get_mset(
-                        info[0].ToNumber(), info[1].ToNumber(), checkatleast)));
+    auto key = cache_key(first, maxitems, checkatleast);
+    if (auto cached = cache_lookup(key, db_revision(true))) {
+      return MSet::New(info.Env(), *cached, false, NewStats(true));
+    }
+    Metrics::Timer timer(Metrics::GET_MSET);
+    // Made, and cached, outside the lock, which the destructor of any
+    // LockedMSet on this database takes too.
+    auto mset = std::make_shared<LockedMSet>(db_mutex_);
+    Facets facets;
+    std::chrono::steady_clock::time_point start;
+    std::string revision;
+    {
+      std::lock_guard<std::mutex> lock(*db_mutex_);
+      TRY_CATCH_XAPIAN_CALLBACK_INFO(Sync());
+      // The spies only belong to this match.
+      struct ClearSpies {
+        Xapian::Enquire& enquire;
+        ~ClearSpies() { enquire.clear_matchspies(); }
+      } clear_spies{*enquire_};
+      facets = TRY_CATCH_XAPIAN_CALLBACK_INFO(
+          ValueCountMatchSpy::AddFacets(*enquire_, settings_.facets));
+      start = std::chrono::steady_clock::now();
+      mset->mset = TRY_CATCH_XAPIAN_CALLBACK_INFO(
+          enquire_->get_mset(first, maxitems, checkatleast));
+      revision = locked_revision();
+    }
+    auto stats = NewStats(false);
+    if (stats) {
+      stats->match_ms = MillisecondsSince(start);
+    }
+    bool truncated = Overran(settings_.time_limit, start);
+    if (cacheable() && !truncated && !revision.empty()) {
+      cache_->put(AtRevision(key, revision), mset, CacheBytes(*mset));
+    }
+    ShowFacets(matchspies_, facets);
+    return MSet::New(info.Env(), mset, truncated, std::move(stats),
+                     std::move(facets));
   }
 
+  Napi::Value get_mset_async(const Napi::CallbackInfo& info) {
+    auto env = info.Env();
+    Xapian::doccount first = info[0].ToNumber();
+    Xapian::doccount maxitems = info[1].ToNumber();
+    Xapian::doccount checkatleast = 0;
+    if (info.Length() > 2) {
+      checkatleast = info[2].ToNumber();
+    }
+    // {signal: AbortSignal} cancels the match, rejecting the promise with an
+    // AbortError, as does a signal which is aborted already.
+    Napi::Object signal;
+    if (info[3].IsObject() && info[3].As<Napi::Object>().Has("signal")) {
+      signal = info[3].As<Napi::Object>().Get("signal").As<Napi::Object>();
+      if (signal.Get("aborted").ToBoolean()) {
+        auto deferred = Napi::Promise::Deferred::New(env);
+        deferred.Reject(AbortError(env));
+        return deferred.Promise();
+      }
+    }
+    auto key = cache_key(first, maxitems, checkatleast);
+    if (auto cached = cache_lookup(key, db_revision(false))) {
+      auto deferred = Napi::Promise::Deferred::New(env);
+      deferred.Resolve(MSet::New(env, *cached, false, NewStats(true)));
+      return deferred.Promise();
+    }
+    Napi::Function listener;
+    auto cancelled = std::make_shared<std::atomic<bool>>(false);
+    if (!signal.IsEmpty()) {
+      listener = Napi::Function::New(
+          env, [cancelled](const Napi::CallbackInfo&) { *cancelled = true; });
+      auto listener_opts = Napi::Object::New(env);
+      listener_opts.Set("once", true);
+      signal.Get("addEventListener")
+          .As<Napi::Function>()
+          .Call(signal, {Napi::String::New(env, "abort"), listener,
+                         listener_opts});
+    }
+
+    auto db = Napi::ObjectWrap<Database>::Unwrap(database_.Value());
+    auto worker = new GetMSetWorker(
+        env, db->readers(env),
+        TRY_CATCH_XAPIAN_CALLBACK_INFO(settings_.detached()), first, maxitems,
+        checkatleast);
+    if (!signal.IsEmpty()) {
+      worker->set_signal(signal, listener, cancelled);
+    }
+    if (cacheable()) {
+      worker->set_cache(cache_, key);
+    }
+    worker->set_stats(NewStats(false));
+    for (auto& spy : matchspies_) {
+      worker->add_spy(spy.Value());
+    }
+    worker->Queue();
+    return worker->Promise();
+  }
+
+  void set_result_cache(const Napi::CallbackInfo& info) {
+    size_t max_entries = 1000;
+    size_t max_bytes = 0;
+    if (info.Length() > 0 && info[0].IsObject()) {
+      auto opts = info[0].As<Napi::Object>();
+      if (opts.Has("maxEntries")) {
+        max_entries = opts.Get("maxEntries").ToNumber().Int64Value();
+      }
+      if (opts.Has("maxBytes")) {
+        max_bytes = opts.Get("maxBytes").ToNumber().Int64Value();
+      }
+    } else if (info.Length() > 0 && !info[0].ToBoolean()) {
+      max_entries = 0;
+    }
+    cache_->resize(max_entries, max_bytes);
+  }
+
+  Napi::Value get_result_cache_stats(const Napi::CallbackInfo& info) {
+    return cache_->stats(info.Env());
+  }
+
+  void clear_result_cache(const Napi::CallbackInfo& info) { cache_->clear(); }
+
   Napi::Value get_description(const Napi::CallbackInfo& info) {
     return TRY_CATCH_XAPIAN_CALLBACK_INFO(
         Napi::String::New(info.Env(), enquire_->get_description()));
@@ -62,9 +270,27 @@ class Enquire : public Napi::ObjectWrap<Enquire> {
         {
             InstanceMethod("set_query", &Enquire::set_query),
             InstanceMethod("set_docid_order", &Enquire::set_docid_order),
+            InstanceMethod("set_collapse_key", &Enquire::set_collapse_key),
+            InstanceMethod("set_time_limit", &Enquire::set_time_limit),
+            InstanceMethod("set_stats", &Enquire::set_stats),
+            InstanceMethod("set_weighting_scheme",
+                           &Enquire::set_weighting_scheme),
+            InstanceMethod("add_matchspy", &Enquire::add_matchspy),
+            InstanceMethod("clear_matchspies", &Enquire::clear_matchspies),
             InstanceMethod("set_sort_by_relevance",
                            &Enquire::set_sort_by_relevance),
+            InstanceMethod("set_sort_by_value", &Enquire::set_sort_by_value),
+            InstanceMethod("set_sort_by_value_then_relevance",
+                           &Enquire::set_sort_by_value_then_relevance),
+            InstanceMethod("set_sort_by_relevance_then_value",
+                           &Enquire::set_sort_by_relevance_then_value),
+            InstanceMethod("set_sort_by_key", &Enquire::set_sort_by_key),
             InstanceMethod("get_mset", &Enquire::get_mset),
+            InstanceMethod("get_mset_async", &Enquire::get_mset_async),
+            InstanceMethod("set_result_cache", &Enquire::set_result_cache),
+            InstanceMethod("get_result_cache_stats",
+                           &Enquire::get_result_cache_stats),
+            InstanceMethod("clear_result_cache", &Enquire::clear_result_cache),
             InstanceMethod("get_description", &Enquire::get_description),
             InstanceMethod("toString", &Enquire::get_description),
 
@@ -76,13 +302,446 @@ class Enquire : public Napi::ObjectWrap<Enquire> {
             StaticValue("DONT_CARE",
                         Napi::Number::New(env, Xapian::Enquire::DONT_CARE)),
         });
-    constructor = Napi::Persistent(func);
-    constructor.SuppressDestruct();
+    AddonData::SetConstructor<Enquire>(env, func);
     exports.Set("Enquire", func);
   }
 
  private:
-  inline static Napi::FunctionReference constructor;
+  // Settings applied so far, replayed onto a private Xapian::Enquire for each
+  // async match so later setter calls can't race with the worker thread.
+  struct Settings {
+    enum SortBy {
+      SORT_RELEVANCE,
+      SORT_VALUE,
+      SORT_VALUE_THEN_RELEVANCE,
+      SORT_RELEVANCE_THEN_VALUE,
+      SORT_KEY,
+    };
+
+    Xapian::Query query;
+    Xapian::Enquire::docid_order docid_order = Xapian::Enquire::ASCENDING;
+    SortBy sort_by = SORT_RELEVANCE;
+    Xapian::valueno sort_slot = 0;
+    bool sort_reverse = false;
+    // (slot, reverse) pairs for the MultiValueKeyMaker used by SORT_KEY.
+    std::vector<std::pair<Xapian::valueno, bool>> sort_keys;
+    Xapian::valueno collapse_key = Xapian::BAD_VALUENO;
+    Xapian::doccount collapse_max = 1;
+    double time_limit = 0;
+    // Prototype handed to each Enquire, which clones it; null means BM25.
+    std::shared_ptr<const Xapian::Weight> weight;
+    // Slots of the spies in Enquire::matchspies_, which each match counts
+    // with spies of its own.
+    std::vector<Xapian::valueno> facets;
+
+    // A copy sharing no Xapian object with this one, for a match on another
+    // thread; Xapian's reference counts are not atomic.
+    Settings detached() const {
+      Settings settings = *this;
+      settings.query = Xapian::Query::unserialise(query.serialise());
+      if (weight) {
+        settings.weight.reset(weight->clone());
+      }
+      return settings;
+    }
+
+    void apply(Xapian::Enquire& enquire) const {
+      enquire.set_query(query);
+      enquire.set_docid_order(docid_order);
+      enquire.set_collapse_key(collapse_key, collapse_max);
+      enquire.set_time_limit(time_limit);
+      if (weight) {
+        enquire.set_weighting_scheme(*weight);
+      }
+      apply_sort(enquire);
+    }
+
+    void apply_sort(Xapian::Enquire& enquire) const {
+      switch (sort_by) {
+        case SORT_RELEVANCE:
+          enquire.set_sort_by_relevance();
+          break;
+        case SORT_VALUE:
+          enquire.set_sort_by_value(sort_slot, sort_reverse);
+          break;
+        case SORT_VALUE_THEN_RELEVANCE:
+          enquire.set_sort_by_value_then_relevance(sort_slot, sort_reverse);
+          break;
+        case SORT_RELEVANCE_THEN_VALUE:
+          enquire.set_sort_by_relevance_then_value(sort_slot, sort_reverse);
+          break;
+        case SORT_KEY: {
+          // Each Enquire gets its own KeyMaker, so none is shared between
+          // threads.
+          auto keymaker = new Xapian::MultiValueKeyMaker();
+          for (auto& key : sort_keys) {
+            keymaker->add_value(key.first, key.second);
+          }
+          enquire.set_sort_by_key(keymaker->release(), sort_reverse);
+          break;
+        }
+      }
+    }
+
+    // Identifies everything that affects the match, for the result cache.
+    std::string key() const {
+      std::string key = query.serialise();
+      key += '\0';
+      key += std::to_string(docid_order);
+      key += ':' + std::to_string(sort_by);
+      key += ':' + std::to_string(sort_slot);
+      key += ':' + std::to_string(sort_reverse);
+      for (auto& sort_key : sort_keys) {
+        key += ':' + std::to_string(sort_key.first) +
+               (sort_key.second ? 'r' : 'f');
+      }
+      key += ':' + std::to_string(collapse_key);
+      key += ':' + std::to_string(collapse_max);
+      key += ':' + std::to_string(time_limit);
+      if (weight) {
+        key += '\0' + weight->name() + '\0' + weight->serialise();
+      }
+      return key;
+    }
+  };
+
+  void set_sort(const Napi::CallbackInfo& info, Settings::SortBy sort_by) {
+    Settings settings = settings_;
+    settings.sort_by = sort_by;
+    settings.sort_slot = 0;
+    settings.sort_reverse = false;
+    settings.sort_keys.clear();
+    if (sort_by == Settings::SORT_KEY) {
+      if (!info[0].IsArray()) {
+        throw Napi::Error::New(info.Env(), "sort keys must be an array");
+      }
+      auto arr = info[0].As<Napi::Array>();
+      for (uint32_t i = 0; i < arr.Length(); i++) {
+        auto key = arr.Get(i).As<Napi::Object>();
+        bool reverse = key.Has("reverse") && key.Get("reverse").ToBoolean();
+        settings.sort_keys.emplace_back(
+            key.Get("slot").ToNumber().Uint32Value(), reverse);
+      }
+      settings.sort_reverse = info.Length() > 1 && info[1].ToBoolean();
+    } else if (sort_by != Settings::SORT_RELEVANCE) {
+      settings.sort_slot = info[0].ToNumber();
+      settings.sort_reverse = info.Length() > 1 && info[1].ToBoolean();
+    }
+    TRY_CATCH_XAPIAN_CALLBACK_INFO(settings.apply_sort(*enquire_));
+    settings_ = settings;
+  }
+
+  using ResultCache = LruCache<std::shared_ptr<LockedMSet>>;
+
+  // The Xapian::Enquire holds its own copy of the database handle, which
+  // doesn't see shards added to the Database since. Once the database
+  // changes, the enquire is made again from it with the same settings.
+  // Called with the database mutex held.
+  void Sync() {
+    if (*db_generation_ == synced_generation_) {
+      return;
+    }
+    auto db = Napi::ObjectWrap<Database>::Unwrap(database_.Value());
+    auto enquire = std::make_shared<Xapian::Enquire>(*db);
+    settings_.apply(*enquire);
+    enquire_ = enquire;
+    synced_generation_ = *db_generation_;
+  }
+
+  // Points the spy wrappers at the counts of the match they were used for.
+  static void ShowFacets(const std::vector<Napi::ObjectReference>& spies,
+                         const Facets& facets) {
+    for (size_t i = 0; i < spies.size() && i < facets.size(); i++) {
+      Napi::ObjectWrap<ValueCountMatchSpy>::Unwrap(spies[i].Value())
+          ->set_spy(facets[i].spy);
+    }
+  }
+
+  inline static const char* kAbortMessage = "The match was aborted";
+
+  // A DOMException named AbortError, which is what other AbortSignal users
+  // such as fetch() reject with, or an Error of that name where the runtime
+  // has no DOMException.
+  static Napi::Value AbortError(Napi::Env env) {
+    auto dom_exception = env.Global().Get("DOMException");
+    if (dom_exception.IsFunction()) {
+      return dom_exception.As<Napi::Function>().New(
+          {Napi::String::New(env, kAbortMessage),
+           Napi::String::New(env, "AbortError")});
+    }
+    auto err = Napi::Error::New(env, kAbortMessage);
+    err.Set("name", "AbortError");
+    return err.Value();
+  }
+
+  // Aborts the match from inside the matcher once `cancelled` is set.
+  class CancelSpy : public Xapian::MatchSpy {
+   public:
+    struct Cancelled : std::runtime_error {
+      Cancelled() : std::runtime_error(kAbortMessage) {}
+    };
+
+    explicit CancelSpy(std::shared_ptr<std::atomic<bool>> cancelled)
+        : cancelled_(cancelled) {}
+
+    void operator()(const Xapian::Document&, double) override {
+      if (*cancelled_) {
+        throw Cancelled();
+      }
+    }
+
+   private:
+    std::shared_ptr<std::atomic<bool>> cancelled_;
+  };
+
+  static std::shared_ptr<const Xapian::Weight> NewWeight(
+      Napi::Env env, const Napi::Value& name, const Napi::Value& params) {
+    auto opts = params.IsObject() ? params.As<Napi::Object>()
+                                  : Napi::Object::New(env);
+    auto param = [&](const char* key, double def) {
+      return opts.Has(key) ? opts.Get(key).ToNumber().DoubleValue() : def;
+    };
+    std::string scheme = name.ToString();
+    std::shared_ptr<const Xapian::Weight> weight;
+    if (scheme == "BM25Weight") {
+      weight = TRY_CATCH_XAPIAN(
+          env, std::make_shared<Xapian::BM25Weight>(
+                   param("k1", 1), param("k2", 0), param("k3", 1),
+                   param("b", 0.5), param("min_normlen", 0.5)));
+    } else if (scheme == "BM25PlusWeight") {
+      weight = TRY_CATCH_XAPIAN(
+          env, std::make_shared<Xapian::BM25PlusWeight>(
+                   param("k1", 1), param("k2", 0), param("k3", 1),
+                   param("b", 0.5), param("min_normlen", 0.5),
+                   param("delta", 1)));
+    } else if (scheme == "TfIdfWeight") {
+      std::string normalizations = "ntn";
+      if (opts.Has("normalizations")) {
+        normalizations = opts.Get("normalizations").ToString();
+      }
+      weight = TRY_CATCH_XAPIAN(
+          env, std::make_shared<Xapian::TfIdfWeight>(normalizations));
+    } else if (scheme == "BoolWeight") {
+      weight = std::make_shared<Xapian::BoolWeight>();
+    } else if (scheme == "CoordWeight") {
+      weight = std::make_shared<Xapian::CoordWeight>();
+    } else {
+      throw Napi::Error::New(env, "unknown weighting scheme " + scheme);
+    }
+    return weight;
+  }
+
+  // Starts the stats for one get_mset call, or returns nullptr when they
+  // are off.
+  std::unique_ptr<QueryStats> NewStats(bool cached) const {
+    if (!stats_) {
+      return nullptr;
+    }
+    auto stats = std::make_unique<QueryStats>();
+    stats->query = settings_.query;
+    stats->parse_ms = parse_ms_;
+    stats->cached = cached;
+    return stats;
+  }
+
+  // Xapian doesn't report whether the time limit cut a match short, so a
+  // match is taken as truncated when it ran for at least the limit.
+  static bool Overran(double time_limit,
+                      std::chrono::steady_clock::time_point start) {
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    return time_limit > 0 && elapsed.count() >= time_limit;
+  }
+
+  // Rough size of one hit in a Xapian::MSet, used to enforce maxBytes.
+  static constexpr size_t kCachedHitBytes = 96;
+
+  static size_t CacheBytes(LockedMSet& mset) {
+    auto lock = mset.Lock();
+    return sizeof(LockedMSet) + mset.mset.size() * kCachedHitBytes;
+  }
+
+  // Matches with spies attached are never cached, as a cache hit would
+  // skip the counting.
+  bool cacheable() const {
+    return cache_->enabled() && settings_.facets.empty();
+  }
+
+  std::string cache_key(Xapian::doccount first, Xapian::doccount maxitems,
+                        Xapian::doccount checkatleast) {
+    if (!cacheable()) {
+      return std::string();
+    }
+    return TRY_CATCH_XAPIAN(Env(), settings_.key()) + '\0' +
+           std::to_string(first) + ':' + std::to_string(maxitems) + ':' +
+           std::to_string(checkatleast);
+  }
+
+  // Results are cached under the revision they were matched at, which for
+  // get_mset_async() is that of the reader it leased, and only served to a
+  // database at that same revision.
+  static std::string AtRevision(const std::string& key,
+                                const std::string& revision) {
+    return key + '\0' + revision;
+  }
+
+  const std::shared_ptr<LockedMSet>* cache_lookup(
+      const std::string& key, const std::string& revision) {
+    if (!cacheable() || revision.empty()) {
+      return nullptr;
+    }
+    return cache_->get(AtRevision(key, revision));
+  }
+
+  // The revision the database is at, or empty when it can't tell, such as
+  // once closed. Unless `wait`, a database busy with async work counts as
+  // unknown rather than being waited for.
+  std::string db_revision(bool wait) {
+    if (!cacheable()) {
+      return std::string();
+    }
+    std::unique_lock<std::mutex> lock(*db_mutex_, std::defer_lock);
+    if (wait) {
+      lock.lock();
+    } else if (!lock.try_lock()) {
+      return std::string();
+    }
+    return locked_revision();
+  }
+
+  // Called with the database mutex held.
+  std::string locked_revision() {
+    try {
+      return Napi::ObjectWrap<Database>::Unwrap(database_.Value())
+          ->revision();
+    } catch (Xapian::Error&) {
+      return std::string();
+    }
+  }
+
+  // Leases one of the database's readers and matches with its own
+  // Xapian::Enquire, so nothing it touches is shared with the main thread.
+  // The MSet is locked by the reader's mutex, which the next lease of the
+  // reader waits for too.
+  class GetMSetWorker : public PromiseWorker {
+   public:
+    GetMSetWorker(Napi::Env env,
+                  std::shared_ptr<SharedDatabase::Handle> readers,
+                  Settings settings, Xapian::doccount first,
+                  Xapian::doccount maxitems, Xapian::doccount checkatleast)
+        : PromiseWorker(env),
+          readers_(std::move(readers)),
+          settings_(std::move(settings)),
+          first_(first),
+          maxitems_(maxitems),
+          checkatleast_(checkatleast) {}
+
+    // Stores the result in `cache` at the revision of the reader used.
+    void set_cache(std::shared_ptr<ResultCache> cache, const std::string& key) {
+      cache_ = cache;
+      key_ = key;
+    }
+
+    void set_stats(std::unique_ptr<QueryStats> stats) {
+      stats_ = std::move(stats);
+    }
+
+    // Cancels the match when `signal` aborts before the promise settles.
+    // The listener is removed again once the match completes.
+    void set_signal(Napi::Object signal, Napi::Function listener,
+                    std::shared_ptr<std::atomic<bool>> cancelled) {
+      signal_ = Napi::Persistent(signal);
+      listener_ = Napi::Persistent(listener);
+      cancelled_ = cancelled;
+      cancel_ = std::make_unique<CancelSpy>(cancelled);
+    }
+
+    // A spy added to the enquire, updated with this match's counts.
+    void add_spy(Napi::Object obj) { spies_.push_back(Napi::Persistent(obj)); }
+
+   protected:
+    void Run() override {
+      Metrics::Timer timer(Metrics::GET_MSET);
+      auto lease = readers_->Acquire();
+      mset_ = std::make_shared<LockedMSet>(lease.mutex());
+      Xapian::Enquire enquire(lease.db());
+      settings_.apply(enquire);
+      facets_ = ValueCountMatchSpy::AddFacets(enquire, settings_.facets);
+      if (cancel_) {
+        enquire.add_matchspy(cancel_.release()->release());
+      }
+      auto start = std::chrono::steady_clock::now();
+      try {
+        mset_->mset = enquire.get_mset(first_, maxitems_, checkatleast_);
+      } catch (CancelSpy::Cancelled&) {
+        return;
+      }
+      match_ms_ = MillisecondsSince(start);
+      truncated_ = Overran(settings_.time_limit, start);
+      if (cache_) {
+        try {
+          revision_ = lease.revision();
+        } catch (Xapian::Error&) {
+          // left uncached
+        }
+      }
+    }
+
+    void Cleanup(Napi::Env env) override {
+      if (signal_.IsEmpty()) {
+        return;
+      }
+      auto signal = signal_.Value();
+      signal.Get("removeEventListener")
+          .As<Napi::Function>()
+          .Call(signal, {Napi::String::New(env, "abort"), listener_.Value()});
+    }
+
+    Napi::Value Result(Napi::Env env) override {
+      if (cancelled_ && *cancelled_) {
+        throw Napi::Error(env, AbortError(env));
+      }
+      if (cache_ && !truncated_ && !revision_.empty()) {
+        cache_->put(AtRevision(key_, revision_), mset_, CacheBytes(*mset_));
+      }
+      if (stats_) {
+        stats_->match_ms = match_ms_;
+      }
+      ShowFacets(spies_, facets_);
+      return MSet::New(env, mset_, truncated_, std::move(stats_),
+                       std::move(facets_));
+    }
+
+   private:
+    std::shared_ptr<ResultCache> cache_;
+    std::string key_;
+    std::string revision_;
+    std::vector<Napi::ObjectReference> spies_;
+    std::shared_ptr<SharedDatabase::Handle> readers_;
+    Settings settings_;
+    Napi::ObjectReference signal_;
+    Napi::FunctionReference listener_;
+    std::shared_ptr<std::atomic<bool>> cancelled_;
+    std::unique_ptr<CancelSpy> cancel_;
+    Xapian::doccount first_;
+    Xapian::doccount maxitems_;
+    Xapian::doccount checkatleast_;
+    std::shared_ptr<LockedMSet> mset_;
+    Facets facets_;
+    bool truncated_ = false;
+    double match_ms_ = 0;
+    std::unique_ptr<QueryStats> stats_;
+  };
+
   std::shared_ptr<Xapian::Enquire> enquire_;
+  Napi::ObjectReference database_;
+  std::shared_ptr<std::mutex> db_mutex_;
+  std::shared_ptr<uint64_t> db_generation_;
+  uint64_t synced_generation_ = 0;
+  Settings settings_;
+  std::vector<Napi::ObjectReference> matchspies_;
+  std::shared_ptr<ResultCache> cache_ = std::make_shared<ResultCache>();
+  bool stats_ = false;
+  double parse_ms_ = 0;
 };
 
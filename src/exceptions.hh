@@ -5,14 +5,17 @@
 
 #include <string>
 
-#define TRY_CATCH_XAPIAN(env, ...)                                  \
-  [&]() -> decltype(auto) {                                         \
-    try {                                                           \
-      return __VA_ARGS__;                                           \
-    } catch (Xapian::Error & err) {                                 \
-      throw Napi::Error::New(                                       \
-          env, std::string(err.get_type()) + ": " + err.get_msg()); \
-    }                                                               \
+inline std::string XapianErrorMessage(const Xapian::Error& err) {
+  return std::string(err.get_type()) + ": " + err.get_msg();
+}
+
+#define TRY_CATCH_XAPIAN(env, ...)                          \
+  [&]() -> decltype(auto) {                                 \
+    try {                                                   \
+      return __VA_ARGS__;                                   \
+    } catch (Xapian::Error & err) {                         \
+      throw Napi::Error::New(env, XapianErrorMessage(err)); \
+    }                                                       \
   }()
 
 #define TRY_CATCH_XAPIAN_CALLBACK_INFO(...) \
@@ -0,0 +1,326 @@
+#pragma once
+
+#include <napi.h>
+#include <xapian.h>
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "addondata.hh"
+#include "exceptions.hh"
+#include "promiseworker.hh"
+#include "writabledatabase.hh"
+
+// Builds and adds documents from plain JS records according to a schema
+// declared once up front, so each record costs a single pass in C++ instead
+// of a round of Document/TermGenerator calls from JS.
+class Indexer : public Napi::ObjectWrap<Indexer> {
+ public:
+  struct Field {
+    std::string field;
+    std::string prefix;
+    Xapian::termcount wdf = 1;
+    bool positions = true;
+    bool boolean = false;
+    bool data = false;
+    Xapian::valueno slot = Xapian::BAD_VALUENO;
+  };
+
+  // Text extracted from one field of a record. `value` holds the string
+  // stored in the value slot, sortable_serialise()d when the JS value is a
+  // number.
+  struct FieldValue {
+    std::string text;
+    std::string value;
+  };
+
+  // One entry per schema field, each holding every value of that field.
+  using Record = std::vector<std::vector<FieldValue>>;
+
+  struct Config {
+    std::vector<Field> fields;
+    std::string language = "none";
+    int flags = 0;
+    Xapian::TermGenerator::stem_strategy stemming_strategy =
+        Xapian::TermGenerator::STEM_SOME;
+    // Identifies the config, and any copy of it, for ThreadTermGenerator().
+    uint64_t id = 0;
+  };
+
+  Indexer(const Napi::CallbackInfo& info) : Napi::ObjectWrap<Indexer>(info) {
+    auto env = info.Env();
+    Napi::HandleScope scope(env);
+    config_ = ParseConfig(env, info[0], info[1]);
+  }
+
+  // Reads the field schema and the optional TermGenerator settings.
+  static Config ParseConfig(Napi::Env env, const Napi::Value& fields,
+                            const Napi::Value& options) {
+    if (!fields.IsArray()) {
+      throw Napi::Error::New(env, "fields must be an array");
+    }
+    static std::atomic<uint64_t> next_id{1};
+    Config config;
+    config.id = next_id.fetch_add(1, std::memory_order_relaxed);
+    auto arr = fields.As<Napi::Array>();
+    for (uint32_t i = 0; i < arr.Length(); i++) {
+      config.fields.push_back(ParseField(env, arr.Get(i)));
+    }
+
+    if (options.IsObject()) {
+      auto opts = options.As<Napi::Object>();
+      if (opts.Has("stemmer")) {
+        config.language = opts.Get("stemmer").ToString();
+        TRY_CATCH_XAPIAN(env, Xapian::Stem(config.language));
+      }
+      if (opts.Has("flags")) {
+        config.flags = opts.Get("flags").ToNumber();
+      }
+      if (opts.Has("stemming_strategy")) {
+        config.stemming_strategy =
+            static_cast<Xapian::TermGenerator::stem_strategy>(
+                opts.Get("stemming_strategy").ToNumber().Int32Value());
+      }
+    }
+    return config;
+  }
+
+  // Creates a TermGenerator for `config`. Each thread building documents
+  // needs its own, as Xapian objects can't be shared between threads.
+  static Xapian::TermGenerator NewTermGenerator(const Config& config) {
+    Xapian::TermGenerator tg;
+    tg.set_stemmer(Xapian::Stem(config.language));
+    tg.set_stemming_strategy(config.stemming_strategy);
+    tg.set_flags(config.flags);
+    return tg;
+  }
+
+  // Returns this thread's TermGenerator for `config`, made on first use, so
+  // batches on the same thread don't set up a stemmer each time. A thread
+  // which goes on to index for another config replaces it.
+  static Xapian::TermGenerator& ThreadTermGenerator(const Config& config) {
+    thread_local uint64_t id = 0;
+    thread_local Xapian::TermGenerator tg;
+    if (id != config.id) {
+      tg = NewTermGenerator(config);
+      id = config.id;
+    }
+    return tg;
+  }
+
+  // Leaves `tg` holding no reference to the document, which may go on to be
+  // used on another thread.
+  static Xapian::Document BuildDocument(const Config& config,
+                                        Xapian::TermGenerator& tg,
+                                        const Record& record) {
+    Xapian::Document doc;
+    tg.set_document(doc);
+    for (size_t i = 0; i < config.fields.size(); i++) {
+      auto& field = config.fields[i];
+      for (auto& value : record[i]) {
+        if (field.data) {
+          doc.set_data(value.text);
+        }
+        if (field.slot != Xapian::BAD_VALUENO) {
+          doc.add_value(field.slot, value.value);
+        }
+        if (field.boolean) {
+          doc.add_boolean_term(field.prefix + value.text);
+        } else if (field.wdf > 0) {
+          if (field.positions) {
+            tg.index_text(value.text, field.wdf, field.prefix);
+          } else {
+            tg.index_text_without_positions(value.text, field.wdf,
+                                            field.prefix);
+          }
+          tg.increase_termpos();
+        }
+      }
+    }
+    tg.set_document(Xapian::Document());
+    return doc;
+  }
+
+  static Record ParseRecord(const Config& config, const Napi::Value& value) {
+    if (!value.IsObject()) {
+      throw Napi::Error::New(value.Env(), "records must be objects");
+    }
+    auto obj = value.As<Napi::Object>();
+    Record record(config.fields.size());
+    for (size_t i = 0; i < config.fields.size(); i++) {
+      auto& field = config.fields[i];
+      if (!obj.Has(field.field)) {
+        continue;
+      }
+      auto v = obj.Get(field.field);
+      if (v.IsArray()) {
+        auto arr = v.As<Napi::Array>();
+        for (uint32_t j = 0; j < arr.Length(); j++) {
+          AppendFieldValue(field, arr.Get(j), record[i]);
+        }
+      } else {
+        AppendFieldValue(field, v, record[i]);
+      }
+    }
+    return record;
+  }
+
+  static std::vector<Record> ParseRecords(const Config& config,
+                                          const Napi::Value& value) {
+    if (!value.IsArray()) {
+      throw Napi::Error::New(value.Env(), "records must be an array");
+    }
+    auto arr = value.As<Napi::Array>();
+    std::vector<Record> records;
+    records.reserve(arr.Length());
+    for (uint32_t i = 0; i < arr.Length(); i++) {
+      records.push_back(ParseRecord(config, arr.Get(i)));
+    }
+    return records;
+  }
+
+  Napi::Value add_records(const Napi::CallbackInfo& info) {
+    auto db = Napi::ObjectWrap<WritableDatabase>::Unwrap(
+        info[0].As<Napi::Object>());
+    auto records = ParseRecords(config_, info[1]);
+    std::lock_guard<std::mutex> lock(*db->get_mutex());
+    Xapian::WritableDatabase wdb = *db;
+    auto docids = TRY_CATCH_XAPIAN_CALLBACK_INFO(AddRecords(
+        config_, wdb, records, WritableDatabase::CommitEvery(info[2])));
+    return WritableDatabase::DocidsToArray(info.Env(), docids);
+  }
+
+  Napi::Value add_records_async(const Napi::CallbackInfo& info) {
+    auto db = Napi::ObjectWrap<WritableDatabase>::Unwrap(
+        info[0].As<Napi::Object>());
+    auto worker = new AddRecordsWorker(
+        info.Env(), config_, *db, db->get_mutex(),
+        ParseRecords(config_, info[1]), WritableDatabase::CommitEvery(info[2]));
+    worker->Queue();
+    return worker->Promise();
+  }
+
+  static void Init(Napi::Env env, Napi::Object exports) {
+    Napi::HandleScope scope(env);
+    Napi::Function func = DefineClass(
+        env, "Indexer",
+        {
+            InstanceMethod("add_records", &Indexer::add_records),
+            InstanceMethod("add_records_async", &Indexer::add_records_async),
+        });
+    AddonData::SetConstructor<Indexer>(env, func);
+    exports.Set("Indexer", func);
+  }
+
+ private:
+  static Field ParseField(Napi::Env env, const Napi::Value& value) {
+    if (!value.IsObject()) {
+      throw Napi::Error::New(env, "fields must be objects");
+    }
+    auto obj = value.As<Napi::Object>();
+    if (!obj.Has("field")) {
+      throw Napi::Error::New(env, "field name is required");
+    }
+    Field field;
+    field.field = obj.Get("field").ToString();
+    if (obj.Has("prefix")) {
+      field.prefix = obj.Get("prefix").ToString();
+    }
+    if (obj.Has("wdf")) {
+      field.wdf = obj.Get("wdf").ToNumber();
+    }
+    if (obj.Has("positions")) {
+      field.positions = obj.Get("positions").ToBoolean();
+    }
+    if (obj.Has("boolean")) {
+      field.boolean = obj.Get("boolean").ToBoolean();
+    }
+    if (obj.Has("data")) {
+      field.data = obj.Get("data").ToBoolean();
+    }
+    if (obj.Has("valueSlot")) {
+      field.slot = obj.Get("valueSlot").ToNumber();
+    }
+    return field;
+  }
+
+  static void AppendFieldValue(const Field& field, const Napi::Value& v,
+                               std::vector<FieldValue>& values) {
+    if (v.IsNull() || v.IsUndefined()) {
+      return;
+    }
+    FieldValue fv;
+    fv.text = v.ToString();
+    if (field.slot != Xapian::BAD_VALUENO) {
+      fv.value = fv.text;
+      if (v.IsNumber()) {
+        fv.value =
+            Xapian::sortable_serialise(v.As<Napi::Number>().DoubleValue());
+      }
+    }
+    values.push_back(std::move(fv));
+  }
+
+  static std::vector<Xapian::docid> AddRecords(
+      const Config& config, Xapian::WritableDatabase& db,
+      const std::vector<Record>& records, Xapian::doccount commit_every) {
+    auto& tg = ThreadTermGenerator(config);
+    // Only spelling data needs the database; the cached TermGenerator must
+    // not keep it open once the batch is done.
+    bool spelling = config.flags & Xapian::TermGenerator::FLAG_SPELLING;
+    if (spelling) {
+      tg.set_database(db);
+    }
+    struct Reset {
+      Xapian::TermGenerator& tg;
+      bool spelling;
+      ~Reset() {
+        if (spelling) {
+          tg.set_database(Xapian::WritableDatabase());
+        }
+      }
+    } reset{tg, spelling};
+    return WritableDatabase::AddInTransaction(
+        db, records.size(), commit_every, [&](size_t i) {
+          return BuildDocument(config, tg, records[i]);
+        });
+  }
+
+  class AddRecordsWorker : public PromiseWorker {
+   public:
+    AddRecordsWorker(Napi::Env env, const Config& config,
+                     Xapian::WritableDatabase db,
+                     std::shared_ptr<std::mutex> mutex,
+                     std::vector<Record> records, Xapian::doccount commit_every)
+        : PromiseWorker(env),
+          config_(config),
+          db_(db),
+          mutex_(mutex),
+          records_(std::move(records)),
+          commit_every_(commit_every) {}
+
+   protected:
+    void Run() override {
+      std::lock_guard<std::mutex> lock(*mutex_);
+      docids_ = AddRecords(config_, db_, records_, commit_every_);
+    }
+
+    Napi::Value Result(Napi::Env env) override {
+      return WritableDatabase::DocidsToArray(env, docids_);
+    }
+
+   private:
+    Config config_;
+    Xapian::WritableDatabase db_;
+    std::shared_ptr<std::mutex> mutex_;
+    std::vector<Record> records_;
+    Xapian::doccount commit_every_;
+    std::vector<Xapian::docid> docids_;
+  };
+
+  Config config_;
+};
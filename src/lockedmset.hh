@@ -0,0 +1,28 @@
+#pragma once
+
+#include <xapian.h>
+
+#include <memory>
+#include <mutex>
+#include <utility>
+
+// A Xapian::MSet with the lock of the database handle it was matched on.
+// Documents, snippets and term statistics are read lazily through that
+// handle, and Xapian's reference counts aren't atomic, so the MSet, and any
+// iterator over it, is only read, copied or destroyed while holding `mutex`.
+struct LockedMSet {
+  explicit LockedMSet(std::shared_ptr<std::mutex> mutex)
+      : mutex(std::move(mutex)) {}
+
+  ~LockedMSet() {
+    std::lock_guard<std::mutex> lock(*mutex);
+    mset = Xapian::MSet();
+  }
+
+  std::unique_lock<std::mutex> Lock() const {
+    return std::unique_lock<std::mutex>(*mutex);
+  }
+
+  const std::shared_ptr<std::mutex> mutex;
+  Xapian::MSet mset;
+};
@@ -0,0 +1,112 @@
+#pragma once
+
+#include <napi.h>
+
+#include <list>
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+// Least-recently-used cache keyed on strings, bounded by entry count and by
+// an estimate of the bytes held. max_entries == 0 disables the cache and
+// max_bytes == 0 means no byte limit. Not thread-safe: only use it from the
+// main thread.
+template <class V>
+class LruCache {
+ public:
+  explicit LruCache(size_t max_entries = 0, size_t max_bytes = 0)
+      : max_entries_(max_entries), max_bytes_(max_bytes) {}
+
+  bool enabled() const { return max_entries_ > 0; }
+
+  // Returns the cached value and marks it most recently used, or nullptr.
+  const V* get(const std::string& key) {
+    if (!enabled()) {
+      return nullptr;
+    }
+    auto it = index_.find(key);
+    if (it == index_.end()) {
+      misses_++;
+      return nullptr;
+    }
+    hits_++;
+    entries_.splice(entries_.begin(), entries_, it->second);
+    return &it->second->value;
+  }
+
+  void put(const std::string& key, V value, size_t bytes) {
+    if (!enabled()) {
+      return;
+    }
+    erase(key);
+    bytes += key.size();
+    if (max_bytes_ > 0 && bytes > max_bytes_) {
+      return;
+    }
+    entries_.push_front(Entry{key, std::move(value), bytes});
+    index_[key] = entries_.begin();
+    bytes_ += bytes;
+    evict();
+  }
+
+  void erase(const std::string& key) {
+    auto it = index_.find(key);
+    if (it != index_.end()) {
+      bytes_ -= it->second->bytes;
+      entries_.erase(it->second);
+      index_.erase(it);
+    }
+  }
+
+  void clear() {
+    entries_.clear();
+    index_.clear();
+    bytes_ = 0;
+  }
+
+  void resize(size_t max_entries, size_t max_bytes) {
+    max_entries_ = max_entries;
+    max_bytes_ = max_bytes;
+    if (!enabled()) {
+      clear();
+    }
+    evict();
+  }
+
+  Napi::Object stats(Napi::Env env) const {
+    auto res = Napi::Object::New(env);
+    res.Set("hits", static_cast<double>(hits_));
+    res.Set("misses", static_cast<double>(misses_));
+    res.Set("entries", static_cast<double>(entries_.size()));
+    res.Set("bytes", static_cast<double>(bytes_));
+    res.Set("maxEntries", static_cast<double>(max_entries_));
+    res.Set("maxBytes", static_cast<double>(max_bytes_));
+    return res;
+  }
+
+ private:
+  struct Entry {
+    std::string key;
+    V value;
+    size_t bytes;
+  };
+
+  void evict() {
+    while (!entries_.empty() &&
+           ((max_entries_ > 0 && entries_.size() > max_entries_) ||
+            (max_bytes_ > 0 && bytes_ > max_bytes_))) {
+      auto& last = entries_.back();
+      bytes_ -= last.bytes;
+      index_.erase(last.key);
+      entries_.pop_back();
+    }
+  }
+
+  size_t max_entries_;
+  size_t max_bytes_;
+  size_t bytes_ = 0;
+  uint64_t hits_ = 0;
+  uint64_t misses_ = 0;
+  std::list<Entry> entries_;
+  std::unordered_map<std::string, typename std::list<Entry>::iterator> index_;
+};
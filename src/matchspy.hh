@@ -0,0 +1,144 @@
+#pragma once
+
+#include <napi.h>
+#include <xapian.h>
+
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "addondata.hh"
+#include "document.hh"
+#include "exceptions.hh"
+
+// The value counts of one match. Each match gets fresh spies, so concurrent
+// matches never update the same one and counts never mix across queries.
+struct Facet {
+  Xapian::valueno slot;
+  std::shared_ptr<Xapian::ValueCountMatchSpy> spy;
+};
+
+using Facets = std::vector<Facet>;
+
+class ValueCountMatchSpy : public Napi::ObjectWrap<ValueCountMatchSpy> {
+ public:
+  ValueCountMatchSpy(const Napi::CallbackInfo& info)
+      : Napi::ObjectWrap<ValueCountMatchSpy>(info) {
+    auto env = info.Env();
+    Napi::HandleScope scope(env);
+
+    if (info.Length() < 1 || !info[0].IsNumber()) {
+      throw Napi::Error::New(env, "first argument must be a value slot");
+    }
+    slot_ = info[0].ToNumber();
+    // MatchSpy objects can't be copied, so the spy lives on the heap.
+    spy_ = std::make_shared<Xapian::ValueCountMatchSpy>(slot_);
+  }
+
+  // Creates a spy per slot and adds it to `enquire`, which doesn't own it.
+  static Facets AddFacets(Xapian::Enquire& enquire,
+                          const std::vector<Xapian::valueno>& slots) {
+    Facets facets;
+    for (auto slot : slots) {
+      facets.push_back(
+          {slot, std::make_shared<Xapian::ValueCountMatchSpy>(slot)});
+      enquire.add_matchspy(facets.back().spy.get());
+    }
+    return facets;
+  }
+
+  // {[slot]: {total, values: [{value, frequency}]}}, see TopValues().
+  static Napi::Object FacetsToObject(Napi::Env env, const Facets& facets,
+                                     size_t maxvalues, bool buffers) {
+    auto res = Napi::Object::New(env);
+    for (auto& facet : facets) {
+      auto obj = Napi::Object::New(env);
+      obj.Set("total", facet.spy->get_total());
+      obj.Set("values", TopValues(env, *facet.spy, maxvalues, buffers));
+      res.Set(facet.slot, obj);
+    }
+    return res;
+  }
+
+  // Returns [{value, frequency}] for the most frequent values, or for all of
+  // them in value order when maxvalues is 0. Values are Buffers when
+  // `buffers` is set, which sortable_serialise()d numbers need.
+  static Napi::Array TopValues(Napi::Env env, Xapian::ValueCountMatchSpy& spy,
+                               size_t maxvalues, bool buffers = false) {
+    auto res = Napi::Array::New(env);
+    auto begin = maxvalues > 0 ? spy.top_values_begin(maxvalues)
+                               : spy.values_begin();
+    auto end =
+        maxvalues > 0 ? spy.top_values_end(maxvalues) : spy.values_end();
+    uint32_t i = 0;
+    for (auto it = begin; it != end; it++, i++) {
+      auto obj = Napi::Object::New(env);
+      if (buffers) {
+        obj.Set("value", Document::ToBuffer(env, *it));
+      } else {
+        obj.Set("value", *it);
+      }
+      obj.Set("frequency", it.get_termfreq());
+      res.Set(i, obj);
+    }
+    return res;
+  }
+
+  Napi::Value get_total(const Napi::CallbackInfo& info) {
+    return Napi::Number::New(
+        info.Env(), TRY_CATCH_XAPIAN_CALLBACK_INFO(spy_->get_total()));
+  }
+
+  Napi::Value top_values(const Napi::CallbackInfo& info) {
+    size_t maxvalues = 0;
+    if (info.Length() > 0) {
+      maxvalues = info[0].ToNumber().Uint32Value();
+    }
+    return TRY_CATCH_XAPIAN_CALLBACK_INFO(
+        TopValues(info.Env(), *spy_, maxvalues, Buffers(info[1])));
+  }
+
+  // Reads `buffers` from an optional options object.
+  static bool Buffers(const Napi::Value& opts) {
+    return opts.IsObject() && opts.As<Napi::Object>().Has("buffers") &&
+           opts.As<Napi::Object>().Get("buffers").ToBoolean();
+  }
+
+  Napi::Value get_slot(const Napi::CallbackInfo& info) {
+    return Napi::Number::New(info.Env(), slot_);
+  }
+
+  Napi::Value get_description(const Napi::CallbackInfo& info) {
+    return Napi::String::New(
+        info.Env(), TRY_CATCH_XAPIAN_CALLBACK_INFO(spy_->get_description()));
+  }
+
+  static void Init(Napi::Env env, Napi::Object exports) {
+    Napi::HandleScope scope(env);
+    Napi::Function func = DefineClass(
+        env, "ValueCountMatchSpy",
+        {
+            InstanceMethod("get_total", &ValueCountMatchSpy::get_total),
+            InstanceMethod("top_values", &ValueCountMatchSpy::top_values),
+            InstanceMethod("get_slot", &ValueCountMatchSpy::get_slot),
+            InstanceAccessor("slot", &ValueCountMatchSpy::get_slot, nullptr),
+            InstanceMethod("get_description",
+                           &ValueCountMatchSpy::get_description),
+            InstanceMethod("toString", &ValueCountMatchSpy::get_description),
+        });
+    AddonData::SetConstructor<ValueCountMatchSpy>(env, func);
+    exports.Set("ValueCountMatchSpy", func);
+  }
+
+  Xapian::valueno slot() const { return slot_; }
+
+  // Shows the counts of `spy`, the latest match this spy was added to.
+  void set_spy(std::shared_ptr<Xapian::ValueCountMatchSpy> spy) {
+    spy_ = std::move(spy);
+  }
+
+ private:
+  Xapian::valueno slot_;
+  std::shared_ptr<Xapian::ValueCountMatchSpy> spy_;
+};
@@ -0,0 +1,174 @@
+#pragma once
+
+#include <napi.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <exception>
+
+// Process-wide call counts and latency histograms for the main operations,
+// shared by every thread and worker_thread. Recording only touches relaxed
+// atomics; xapian.metrics() reads a snapshot.
+//
+// Histograms are log-linear like HdrHistogram: each power of two of
+// microseconds is split into kSubBuckets buckets, so any latency is
+// reported to within 25%.
+class Metrics {
+ public:
+  enum Op {
+    GET_MSET,
+    PARSE_QUERY,
+    ADD_DOCUMENT,
+    REPLACE_DOCUMENT,
+    COMMIT,
+    REOPEN,
+    SNIPPET,
+    kOpCount,
+  };
+
+  // Records the lifetime of the enclosing scope against `op`, as an error
+  // when it is left by an exception.
+  class Timer {
+   public:
+    explicit Timer(Op op)
+        : op_(op),
+          exceptions_(std::uncaught_exceptions()),
+          start_(std::chrono::steady_clock::now()) {}
+
+    ~Timer() {
+      auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+          std::chrono::steady_clock::now() - start_);
+      Record(op_, elapsed.count(), std::uncaught_exceptions() > exceptions_);
+    }
+
+   private:
+    Op op_;
+    int exceptions_;
+    std::chrono::steady_clock::time_point start_;
+  };
+
+  static void Record(Op op, uint64_t micros, bool error) {
+    auto& histogram = histograms_[op];
+    histogram.count.fetch_add(1, std::memory_order_relaxed);
+    histogram.sum_us.fetch_add(micros, std::memory_order_relaxed);
+    histogram.buckets[BucketIndex(micros)].fetch_add(
+        1, std::memory_order_relaxed);
+    if (error) {
+      histogram.errors.fetch_add(1, std::memory_order_relaxed);
+    }
+    uint64_t max = histogram.max_us.load(std::memory_order_relaxed);
+    while (micros > max && !histogram.max_us.compare_exchange_weak(
+                               max, micros, std::memory_order_relaxed)) {
+    }
+  }
+
+  // xapian.metrics() -> {[op]: {count, errors, sum_ms, max_ms, p50_ms,
+  // p90_ms, p99_ms, p999_ms}}
+  static Napi::Value Snapshot(const Napi::CallbackInfo& info) {
+    auto env = info.Env();
+    auto res = Napi::Object::New(env);
+    for (size_t op = 0; op < kOpCount; op++) {
+      auto& histogram = histograms_[op];
+      uint64_t counts[kBuckets];
+      uint64_t total = 0;
+      for (size_t i = 0; i < kBuckets; i++) {
+        counts[i] = histogram.buckets[i].load(std::memory_order_relaxed);
+        total += counts[i];
+      }
+      auto obj = Napi::Object::New(env);
+      obj.Set("count", static_cast<double>(
+                           histogram.count.load(std::memory_order_relaxed)));
+      obj.Set("errors", static_cast<double>(
+                            histogram.errors.load(std::memory_order_relaxed)));
+      obj.Set("sum_ms",
+              histogram.sum_us.load(std::memory_order_relaxed) / 1000.0);
+      obj.Set("max_ms",
+              histogram.max_us.load(std::memory_order_relaxed) / 1000.0);
+      obj.Set("p50_ms", Percentile(counts, total, 0.5));
+      obj.Set("p90_ms", Percentile(counts, total, 0.9));
+      obj.Set("p99_ms", Percentile(counts, total, 0.99));
+      obj.Set("p999_ms", Percentile(counts, total, 0.999));
+      res.Set(kOpNames[op], obj);
+    }
+    return res;
+  }
+
+  static void Reset(const Napi::CallbackInfo& info) {
+    for (auto& histogram : histograms_) {
+      histogram.count = 0;
+      histogram.errors = 0;
+      histogram.sum_us = 0;
+      histogram.max_us = 0;
+      for (auto& bucket : histogram.buckets) {
+        bucket = 0;
+      }
+    }
+  }
+
+  static void Init(Napi::Env env, Napi::Object exports) {
+    exports.Set("metrics", Napi::Function::New(env, Snapshot, "metrics"));
+    exports.Set("resetMetrics",
+                Napi::Function::New(env, Reset, "resetMetrics"));
+  }
+
+ private:
+  static constexpr size_t kSubBits = 2;
+  static constexpr size_t kSubBuckets = 1 << kSubBits;
+  // Up to 2^41us, about 25 days.
+  static constexpr size_t kBuckets = 40 * kSubBuckets;
+
+  inline static const char* kOpNames[kOpCount] = {
+      "get_mset", "parse_query", "add_document", "replace_document",
+      "commit",   "reopen",      "snippet",
+  };
+
+  struct Histogram {
+    std::atomic<uint64_t> count{0};
+    std::atomic<uint64_t> errors{0};
+    std::atomic<uint64_t> sum_us{0};
+    std::atomic<uint64_t> max_us{0};
+    std::atomic<uint64_t> buckets[kBuckets] = {};
+  };
+
+  static size_t BucketIndex(uint64_t micros) {
+    if (micros < kSubBuckets) {
+      return micros;
+    }
+    size_t exponent = 63 - __builtin_clzll(micros);
+    size_t sub = (micros >> (exponent - kSubBits)) & (kSubBuckets - 1);
+    return std::min((exponent - kSubBits + 1) * kSubBuckets + sub,
+                    kBuckets - 1);
+  }
+
+  // Exclusive upper bound of bucket `index`, in microseconds.
+  static uint64_t BucketLimit(size_t index) {
+    if (index < kSubBuckets) {
+      return index + 1;
+    }
+    size_t exponent = index / kSubBuckets + kSubBits - 1;
+    size_t sub = index % kSubBuckets;
+    return static_cast<uint64_t>(kSubBuckets + sub + 1)
+           << (exponent - kSubBits);
+  }
+
+  static double Percentile(const uint64_t* counts, uint64_t total,
+                           double quantile) {
+    if (total == 0) {
+      return 0;
+    }
+    auto rank = static_cast<uint64_t>(std::ceil(quantile * total));
+    uint64_t seen = 0;
+    for (size_t i = 0; i < kBuckets; i++) {
+      seen += counts[i];
+      if (seen >= rank) {
+        return BucketLimit(i) / 1000.0;
+      }
+    }
+    return BucketLimit(kBuckets - 1) / 1000.0;
+  }
+
+  inline static Histogram histograms_[kOpCount];
+};
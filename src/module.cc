@@ -5,10 +5,16 @@
 #include "database.hh"
 #include "document.hh"
 #include "enquire.hh"
+#include "indexer.hh"
+#include "matchspy.hh"
+#include "metrics.hh"
 #include "mset.hh"
+#include "parallelindexer.hh"
 #include "msetiterator.hh"
 #include "query.hh"
 #include "queryparser.hh"
+#include "shareddatabase.hh"
+#include "shardedsearcher.hh"
 #include "stem.hh"
 #include "termgenerator.hh"
 #include "termiterator.hh"
@@ -16,8 +22,10 @@
 
 Napi::Object InitAll(Napi::Env env, Napi::Object exports) {
   Constants::Init(env, exports);
+  Metrics::Init(env, exports);
   TermIterator::Init(env, exports);
   Document::Init(env, exports);
+  SharedDatabase::Init(env, exports);
   Database::Init(env, exports);
   WritableDatabase::Init(env, exports);
   TermGenerator::Init(env, exports);
@@ -27,6 +35,10 @@ Napi::Object InitAll(Napi::Env env, Napi::Object exports) {
   QueryParser::Init(env, exports);
   MSet::Init(env, exports);
   MSetIterator::Init(env, exports);
+  Indexer::Init(env, exports);
+  ParallelIndexer::Init(env, exports);
+  ValueCountMatchSpy::Init(env, exports);
+  ShardedSearcher::Init(env, exports);
   return exports;
 }
 
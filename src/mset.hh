@@ -3,10 +3,25 @@
 #include <napi.h>
 #include <xapian.h>
 
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "addondata.hh"
+#include "document.hh"
 #include "exceptions.hh"
+#include "lockedmset.hh"
+#include "matchspy.hh"
+#include "metrics.hh"
 #include "msetiterator.hh"
+#include "stats.hh"
 #include "stem.hh"
 
+// Every read holds the lock of the database handle the MSet was matched on,
+// see LockedMSet.
 class MSet : public Napi::ObjectWrap<MSet> {
  public:
   MSet(const Napi::CallbackInfo& info) : Napi::ObjectWrap<MSet>(info) {
@@ -17,21 +32,61 @@ class MSet : public Napi::ObjectWrap<MSet> {
       throw Napi::Error::New(env, "mset is required");
     }
 
-    auto msetPtr = info[0].As<Napi::External<Xapian::MSet>>().Data();
+    auto msetPtr =
+        info[0].As<Napi::External<std::shared_ptr<LockedMSet>>>().Data();
     mset_ = *msetPtr;
+    if (info.Length() > 1) {
+      truncated_ = info[1].ToBoolean();
+    }
+  }
+
+  // `truncated` marks a match which was cut short by Enquire's time limit.
+  static Napi::Value New(Napi::Env env, std::shared_ptr<LockedMSet> mset,
+                         bool truncated = false,
+                         std::unique_ptr<QueryStats> stats = nullptr,
+                         Facets facets = {}) {
+    auto eMSet = Napi::External<std::shared_ptr<LockedMSet>>::New(env, &mset);
+    auto obj = AddonData::Constructor<MSet>(env).New(
+        {eMSet, Napi::Boolean::New(env, truncated)});
+    Unwrap(obj)->stats_ = std::move(stats);
+    Unwrap(obj)->facets_ = std::move(facets);
+    return obj;
+  }
+
+  // get_facets(maxvalues = 10, {buffers = false}) -> {[slot]: {total,
+  // values: [{value, frequency}]}} as counted by this match.
+  Napi::Value get_facets(const Napi::CallbackInfo& info) {
+    size_t maxvalues = 10;
+    if (info.Length() > 0 && !info[0].IsUndefined()) {
+      maxvalues = info[0].ToNumber().Uint32Value();
+    }
+    return TRY_CATCH_XAPIAN_CALLBACK_INFO(ValueCountMatchSpy::FacetsToObject(
+        info.Env(), facets_, maxvalues,
+        ValueCountMatchSpy::Buffers(info[1])));
   }
 
-  static Napi::Value New(Napi::Env env, Xapian::MSet mset) {
-    auto eMSet = Napi::External<Xapian::MSet>::New(env, &mset);
-    return constructor.New({eMSet});
+  Napi::Value get_stats(const Napi::CallbackInfo& info) {
+    if (!stats_) {
+      return info.Env().Undefined();
+    }
+    auto lock = mset_->Lock();
+    return TRY_CATCH_XAPIAN_CALLBACK_INFO(
+        stats_->ToObject(info.Env(), mset_->mset));
+  }
+
+  Napi::Value get_truncated(const Napi::CallbackInfo& info) {
+    return Napi::Boolean::New(info.Env(), truncated_);
   }
 
   Napi::Value get_matches_estimated(const Napi::CallbackInfo& info) {
-    return Napi::Number::New(info.Env(), TRY_CATCH_XAPIAN_CALLBACK_INFO(
-                                             mset_.get_matches_estimated()));
+    auto lock = mset_->Lock();
+    return Napi::Number::New(
+        info.Env(),
+        TRY_CATCH_XAPIAN_CALLBACK_INFO(mset_->mset.get_matches_estimated()));
   }
 
   Napi::Value snippet(const Napi::CallbackInfo& info) {
+    Metrics::Timer timer(Metrics::SNIPPET);
     size_t length = 500;
     Xapian::Stem stem;
     uint32_t flags = Xapian::MSet::SNIPPET_BACKGROUND_MODEL |
@@ -63,49 +118,62 @@ class MSet : public Napi::ObjectWrap<MSet> {
                      ? info[1].As<Napi::BigInt>().Uint64Value(nullptr)
                      : static_cast<uint64_t>(info[1].ToNumber().Uint32Value());
     }
+    auto lock = mset_->Lock();
     return Napi::String::New(
-        info.Env(),
-        TRY_CATCH_XAPIAN_CALLBACK_INFO(mset_.snippet(
-            info[0].ToString(), length, stem, flags, hi_start, hi_end, omit)));
+        info.Env(), TRY_CATCH_XAPIAN_CALLBACK_INFO(mset_->mset.snippet(
+                        info[0].ToString(), length, stem, flags, hi_start,
+                        hi_end, omit)));
   }
 
   Napi::Value size(const Napi::CallbackInfo& info) {
-    return Napi::Number::New(info.Env(),
-                             TRY_CATCH_XAPIAN_CALLBACK_INFO(mset_.size()));
+    auto lock = mset_->Lock();
+    return Napi::Number::New(
+        info.Env(), TRY_CATCH_XAPIAN_CALLBACK_INFO(mset_->mset.size()));
   }
 
   Napi::Value empty(const Napi::CallbackInfo& info) {
-    return Napi::Boolean::New(info.Env(),
-                              TRY_CATCH_XAPIAN_CALLBACK_INFO(mset_.empty()));
+    auto lock = mset_->Lock();
+    return Napi::Boolean::New(
+        info.Env(), TRY_CATCH_XAPIAN_CALLBACK_INFO(mset_->mset.empty()));
   }
 
   Napi::Value get_description(const Napi::CallbackInfo& info) {
+    auto lock = mset_->Lock();
     return TRY_CATCH_XAPIAN_CALLBACK_INFO(
-        Napi::String::New(info.Env(), mset_.get_description()));
+        Napi::String::New(info.Env(), mset_->mset.get_description()));
   }
 
+  // The lock is let go while `cb` runs, as it may read the hit.
   void iter(const Napi::CallbackInfo& info) {
     auto env = info.Env();
     auto cb = info[0].As<Napi::Function>();
-    for (auto it = mset_.begin(); it != mset_.end(); it++) {
-      cb.Call(env.Global(), {MSetIterator::New(env, it)});
+    auto lock = mset_->Lock();
+    for (auto it = mset_->mset.begin(); it != mset_->mset.end(); it++) {
+      auto hit = MSetIterator::New(env, mset_, it);
+      lock.unlock();
+      try {
+        cb.Call(env.Global(), {hit});
+      } catch (...) {
+        lock.lock();
+        throw;
+      }
+      lock.lock();
     }
   }
 
   Napi::Value get_iterator(const Napi::CallbackInfo& info) {
     auto env = info.Env();
-    auto begin = mset_.begin();
-    auto end = mset_.end();
+    auto cursor = std::make_shared<Cursor>(mset_);
     auto cb = Napi::Function::New(
-        env, [begin, end](const Napi::CallbackInfo& info) mutable {
+        env, [cursor](const Napi::CallbackInfo& info) {
           auto env = info.Env();
           auto res = Napi::Object::New(env);
-          if (begin != end) {
+          auto lock = cursor->mset->Lock();
+          if (cursor->it != cursor->end) {
             res.Set("value",
-                    MSetIterator::New(info.Env(),
-                                      TRY_CATCH_XAPIAN_CALLBACK_INFO(begin)));
+                    MSetIterator::New(env, cursor->mset, cursor->it));
             res.Set("done", false);
-            TRY_CATCH_XAPIAN_CALLBACK_INFO(begin++);
+            TRY_CATCH_XAPIAN_CALLBACK_INFO(cursor->it++);
             return res;
           }
           res.Set("done", true);
@@ -117,6 +185,116 @@ class MSet : public Napi::ObjectWrap<MSet> {
     return res;
   }
 
+  Napi::Value to_array(const Napi::CallbackInfo& info) {
+    auto env = info.Env();
+    auto start = std::chrono::steady_clock::now();
+    std::vector<Field> fields = {DOCID, WEIGHT, RANK, PERCENT};
+    if (info.Length() > 0 && info[0].IsObject()) {
+      auto opts = info[0].As<Napi::Object>();
+      if (opts.Has("fields")) {
+        auto arr = opts.Get("fields").As<Napi::Array>();
+        fields.clear();
+        for (uint32_t i = 0; i < arr.Length(); i++) {
+          fields.push_back(ParseField(env, arr.Get(i).ToString()));
+        }
+      }
+    }
+
+    // Property names are created once rather than per hit.
+    std::vector<Napi::String> names;
+    for (auto field : fields) {
+      names.push_back(Napi::String::New(env, kFieldNames[field]));
+    }
+
+    auto lock = mset_->Lock();
+    auto res = Napi::Array::New(env, mset_->mset.size());
+    uint32_t i = 0;
+    for (auto it = mset_->mset.begin(); it != mset_->mset.end(); it++, i++) {
+      auto obj = Napi::Object::New(env);
+      for (size_t f = 0; f < fields.size(); f++) {
+        obj.Set(names[f],
+                TRY_CATCH_XAPIAN_CALLBACK_INFO(GetField(env, it, fields[f])));
+      }
+      res.Set(i, obj);
+    }
+    AddFetchTime(start);
+    return res;
+  }
+
+  Napi::Value columns(const Napi::CallbackInfo& info) {
+    auto env = info.Env();
+    auto lock = mset_->Lock();
+    size_t size = mset_->mset.size();
+    auto docids = Napi::Uint32Array::New(env, size);
+    auto weights = Napi::Float64Array::New(env, size);
+    auto percents = Napi::Int32Array::New(env, size);
+    TRY_CATCH_XAPIAN_CALLBACK_INFO(FillColumns(
+        mset_->mset, docids.Data(), weights.Data(), percents.Data()));
+    lock.unlock();
+
+    auto res = Napi::Object::New(env);
+    res.Set("docids", docids);
+    res.Set("weights", weights);
+    res.Set("percents", percents);
+    return res;
+  }
+
+  Napi::Value fetch(const Napi::CallbackInfo& info) {
+    auto env = info.Env();
+    auto start = std::chrono::steady_clock::now();
+    bool data = false;
+    bool buffers = false;
+    std::vector<Xapian::valueno> slots;
+    if (info.Length() > 0 && info[0].IsObject()) {
+      auto opts = info[0].As<Napi::Object>();
+      if (opts.Has("data")) {
+        data = opts.Get("data").ToBoolean();
+      }
+      if (opts.Has("buffers")) {
+        buffers = opts.Get("buffers").ToBoolean();
+      }
+      if (opts.Has("values")) {
+        auto arr = opts.Get("values").As<Napi::Array>();
+        for (uint32_t i = 0; i < arr.Length(); i++) {
+          slots.push_back(arr.Get(i).ToNumber().Uint32Value());
+        }
+      }
+    }
+
+    // Binary values, such as sortable_serialise()d numbers, only survive
+    // as Buffers.
+    auto bytes = [env, buffers](std::string& str) -> Napi::Value {
+      if (buffers) {
+        return Document::ToBuffer(env, std::move(str));
+      }
+      return Napi::String::New(env, str);
+    };
+    std::vector<Hit> hits;
+    {
+      auto lock = mset_->Lock();
+      hits = TRY_CATCH_XAPIAN_CALLBACK_INFO(
+          FetchHits(mset_->mset, data, slots));
+    }
+    auto res = Napi::Array::New(env, hits.size());
+    for (uint32_t i = 0; i < hits.size(); i++) {
+      auto obj = Napi::Object::New(env);
+      obj.Set("docid", hits[i].docid);
+      if (data) {
+        obj.Set("data", bytes(hits[i].data));
+      }
+      if (!slots.empty()) {
+        auto values = Napi::Array::New(env, slots.size());
+        for (uint32_t v = 0; v < slots.size(); v++) {
+          values.Set(v, bytes(hits[i].values[v]));
+        }
+        obj.Set("values", values);
+      }
+      res.Set(i, obj);
+    }
+    AddFetchTime(start);
+    return res;
+  }
+
   static void Init(Napi::Env env, Napi::Object exports) {
     Napi::HandleScope scope(env);
     Napi::Function func = DefineClass(
@@ -130,6 +308,9 @@ class MSet : public Napi::ObjectWrap<MSet> {
             InstanceMethod("get_size", &MSet::size),
             InstanceAccessor("size", &MSet::size, nullptr),
             InstanceMethod("empty", &MSet::empty),
+            InstanceAccessor("truncated", &MSet::get_truncated, nullptr),
+            InstanceAccessor("stats", &MSet::get_stats, nullptr),
+            InstanceMethod("get_facets", &MSet::get_facets),
             InstanceMethod("get_description", &MSet::get_description),
             InstanceMethod("toString", &MSet::get_description),
             InstanceMethod(Napi::Symbol::WellKnown(env, "iterator"),
@@ -137,6 +318,9 @@ class MSet : public Napi::ObjectWrap<MSet> {
 
             // custom methods
             InstanceMethod("iter", &MSet::iter),
+            InstanceMethod("toArray", &MSet::to_array),
+            InstanceMethod("columns", &MSet::columns),
+            InstanceMethod("fetch", &MSet::fetch),
 
             // constants
             StaticValue(
@@ -152,13 +336,142 @@ class MSet : public Napi::ObjectWrap<MSet> {
                 "SNIPPET_CJK_NGRAM",
                 Napi::Number::New(env, Xapian::MSet::SNIPPET_CJK_NGRAM)),
         });
-    constructor = Napi::Persistent(func);
-    constructor.SuppressDestruct();
+    AddonData::SetConstructor<MSet>(env, func);
     exports.Set("MSet", func);
   }
 
  private:
-  inline static Napi::FunctionReference constructor;
-  Xapian::MSet mset_;
+  enum Field {
+    DOCID,
+    WEIGHT,
+    RANK,
+    PERCENT,
+    DATA,
+    COLLAPSE_KEY,
+    COLLAPSE_COUNT,
+    SORT_KEY,
+    NUM_FIELDS
+  };
+
+  inline static const char* kFieldNames[NUM_FIELDS] = {
+      "docid", "weight",       "rank",           "percent",
+      "data",  "collapse_key", "collapse_count", "sort_key",
+  };
+
+  static Field ParseField(Napi::Env env, const std::string& name) {
+    for (int f = 0; f < NUM_FIELDS; f++) {
+      if (name == kFieldNames[f]) {
+        return static_cast<Field>(f);
+      }
+    }
+    throw Napi::Error::New(env, "unknown MSet field: " + name);
+  }
+
+  static Napi::Value GetField(Napi::Env env, const Xapian::MSetIterator& it,
+                              Field field) {
+    switch (field) {
+      case DOCID:
+        return Napi::Number::New(env, *it);
+      case WEIGHT:
+        return Napi::Number::New(env, it.get_weight());
+      case RANK:
+        return Napi::Number::New(env, it.get_rank());
+      case PERCENT:
+        return Napi::Number::New(env, it.get_percent());
+      case DATA:
+        return Napi::String::New(env, it.get_document().get_data());
+      case COLLAPSE_KEY:
+        return Napi::String::New(env, it.get_collapse_key());
+      case COLLAPSE_COUNT:
+        return Napi::Number::New(env, it.get_collapse_count());
+      case SORT_KEY:
+        return Napi::String::New(env, it.get_sort_key());
+      default:
+        return env.Undefined();
+    }
+  }
+
+  static void FillColumns(const Xapian::MSet& mset, uint32_t* docids,
+                          double* weights, int32_t* percents) {
+    size_t i = 0;
+    for (auto it = mset.begin(); it != mset.end(); it++, i++) {
+      docids[i] = *it;
+      weights[i] = it.get_weight();
+      percents[i] = it.get_percent();
+    }
+  }
+
+  struct Hit {
+    Xapian::docid docid;
+    std::string data;
+    std::vector<std::string> values;
+  };
+
+  // Reads the stored data and values of every hit. Documents are prefetched
+  // with MSet::fetch() and then read in docid order for better locality,
+  // while the returned hits stay in rank order.
+  static std::vector<Hit> FetchHits(const Xapian::MSet& mset, bool data,
+                                    const std::vector<Xapian::valueno>& slots) {
+    std::vector<Hit> hits(mset.size());
+    if (!data && slots.empty()) {
+      size_t i = 0;
+      for (auto it = mset.begin(); it != mset.end(); it++, i++) {
+        hits[i].docid = *it;
+      }
+      return hits;
+    }
+
+    mset.fetch();
+    std::vector<std::pair<Xapian::docid, Xapian::doccount>> order;
+    order.reserve(mset.size());
+    for (Xapian::doccount i = 0; i < mset.size(); i++) {
+      order.emplace_back(*mset[i], i);
+    }
+    std::sort(order.begin(), order.end());
+    for (auto& entry : order) {
+      auto& hit = hits[entry.second];
+      auto doc = mset[entry.second].get_document();
+      hit.docid = entry.first;
+      if (data) {
+        hit.data = doc.get_data();
+      }
+      hit.values.reserve(slots.size());
+      for (auto slot : slots) {
+        hit.values.push_back(doc.get_value(slot));
+      }
+    }
+    return hits;
+  }
+
+  // State of one JS iterator over the MSet; the Xapian iterators are
+  // only moved and destroyed under the lock, like the MSet.
+  struct Cursor {
+    explicit Cursor(std::shared_ptr<LockedMSet> locked)
+        : mset(std::move(locked)) {
+      auto lock = mset->Lock();
+      it = mset->mset.begin();
+      end = mset->mset.end();
+    }
+
+    ~Cursor() {
+      auto lock = mset->Lock();
+      it = end = Xapian::MSetIterator();
+    }
+
+    std::shared_ptr<LockedMSet> mset;
+    Xapian::MSetIterator it;
+    Xapian::MSetIterator end;
+  };
+
+  void AddFetchTime(std::chrono::steady_clock::time_point start) {
+    if (stats_) {
+      stats_->fetch_ms += MillisecondsSince(start);
+    }
+  }
+
+  std::shared_ptr<LockedMSet> mset_;
+  Facets facets_;
+  bool truncated_ = false;
+  std::unique_ptr<QueryStats> stats_;
 };
 
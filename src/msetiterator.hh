@@ -3,8 +3,16 @@
 #include <napi.h>
 #include <xapian.h>
 
+#include <memory>
+#include <mutex>
+
+#include "addondata.hh"
+#include "document.hh"
 #include "exceptions.hh"
+#include "lockedmset.hh"
 
+// Holds the lock of its MSet's database handle around every read, see
+// LockedMSet.
 class MSetIterator : public Napi::ObjectWrap<MSetIterator> {
  public:
   MSetIterator(const Napi::CallbackInfo& info)
@@ -20,51 +28,77 @@ class MSetIterator : public Napi::ObjectWrap<MSetIterator> {
     it_ = *ptr;
   }
 
-  static Napi::Value New(Napi::Env env, Xapian::MSetIterator& it) {
+  ~MSetIterator() {
+    if (mset_) {
+      auto lock = mset_->Lock();
+      it_ = Xapian::MSetIterator();
+    }
+  }
+
+  // Call with `mset`'s lock held.
+  static Napi::Value New(Napi::Env env, std::shared_ptr<LockedMSet> mset,
+                         Xapian::MSetIterator& it) {
     auto eIt = Napi::External<Xapian::MSetIterator>::New(env, &it);
-    return constructor.New({eIt});
+    auto obj = AddonData::Constructor<MSetIterator>(env).New({eIt});
+    Unwrap(obj)->mset_ = std::move(mset);
+    return obj;
   }
 
   Napi::Value get_rank(const Napi::CallbackInfo& info) {
+    auto lock = mset_->Lock();
     return Napi::Number::New(info.Env(),
                              TRY_CATCH_XAPIAN_CALLBACK_INFO(it_.get_rank()));
   }
 
   Napi::Value get_document(const Napi::CallbackInfo& info) {
-    return Document::New(info.Env(),
-                         TRY_CATCH_XAPIAN_CALLBACK_INFO(it_.get_document()));
+    Xapian::Document doc;
+    Xapian::docid docid;
+    {
+      auto lock = mset_->Lock();
+      docid = TRY_CATCH_XAPIAN_CALLBACK_INFO(*it_);
+      doc = TRY_CATCH_XAPIAN_CALLBACK_INFO(
+          Document::Detach(it_.get_document()));
+    }
+    return Document::New(info.Env(), doc, docid);
   }
 
   Napi::Value get_weight(const Napi::CallbackInfo& info) {
+    auto lock = mset_->Lock();
     return Napi::Number::New(info.Env(),
                              TRY_CATCH_XAPIAN_CALLBACK_INFO(it_.get_weight()));
   }
 
   Napi::Value get_collapse_key(const Napi::CallbackInfo& info) {
+    auto lock = mset_->Lock();
     return Napi::String::New(
         info.Env(), TRY_CATCH_XAPIAN_CALLBACK_INFO(it_.get_collapse_key()));
   }
 
   Napi::Value get_collapse_count(const Napi::CallbackInfo& info) {
+    auto lock = mset_->Lock();
     return Napi::Number::New(
         info.Env(), TRY_CATCH_XAPIAN_CALLBACK_INFO(it_.get_collapse_count()));
   }
 
   Napi::Value get_sort_key(const Napi::CallbackInfo& info) {
+    auto lock = mset_->Lock();
     return Napi::String::New(
         info.Env(), TRY_CATCH_XAPIAN_CALLBACK_INFO(it_.get_sort_key()));
   }
 
   Napi::Value get_percent(const Napi::CallbackInfo& info) {
+    auto lock = mset_->Lock();
     return Napi::Number::New(info.Env(),
                              TRY_CATCH_XAPIAN_CALLBACK_INFO(it_.get_percent()));
   }
 
   Napi::Value get_docid(const Napi::CallbackInfo& info) {
+    auto lock = mset_->Lock();
     return Napi::Number::New(info.Env(), TRY_CATCH_XAPIAN_CALLBACK_INFO(*it_));
   }
 
   Napi::Value get_description(const Napi::CallbackInfo& info) {
+    auto lock = mset_->Lock();
     return Napi::String::New(
         info.Env(), TRY_CATCH_XAPIAN_CALLBACK_INFO(it_.get_description()));
   }
@@ -92,13 +126,12 @@ class MSetIterator : public Napi::ObjectWrap<MSetIterator> {
             InstanceMethod("get_description", &MSetIterator::get_description),
 
         });
-    constructor = Napi::Persistent(func);
-    constructor.SuppressDestruct();
+    AddonData::SetConstructor<MSetIterator>(env, func);
     exports.Set("MSetIterator", func);
   }
 
  private:
-  inline static Napi::FunctionReference constructor;
+  std::shared_ptr<LockedMSet> mset_;
   Xapian::MSetIterator it_;
 };
 
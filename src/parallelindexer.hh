@@ -0,0 +1,466 @@
+#pragma once
+
+#include <napi.h>
+#include <xapian.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "addondata.hh"
+#include "exceptions.hh"
+#include "indexer.hh"
+#include "metrics.hh"
+#include "writabledatabase.hh"
+
+// Indexes records with a pool of threads, each with its own TermGenerator,
+// while a single writer thread adds the built documents to the database in
+// the order the records were pushed.
+class ParallelIndexer : public Napi::ObjectWrap<ParallelIndexer> {
+ public:
+  ParallelIndexer(const Napi::CallbackInfo& info)
+      : Napi::ObjectWrap<ParallelIndexer>(info) {
+    auto env = info.Env();
+    Napi::HandleScope scope(env);
+
+    if (info.Length() < 2) {
+      throw Napi::Error::New(env, "database and fields are required");
+    }
+    auto db = Napi::ObjectWrap<WritableDatabase>::Unwrap(
+        info[0].As<Napi::Object>());
+    auto config = Indexer::ParseConfig(env, info[1], info[2]);
+    // Spelling data is written through the TermGenerator's database, which
+    // the builder threads can't share with the writer.
+    config.flags &= ~Xapian::TermGenerator::FLAG_SPELLING;
+
+    size_t threads = std::max(1u, std::thread::hardware_concurrency());
+    size_t capacity = 1024;
+    if (info[2].IsObject()) {
+      auto opts = info[2].As<Napi::Object>();
+      if (opts.Has("threads")) {
+        threads = std::max(1u, opts.Get("threads").ToNumber().Uint32Value());
+      }
+      if (opts.Has("queueSize")) {
+        capacity = std::max(1u, opts.Get("queueSize").ToNumber().Uint32Value());
+      }
+    }
+
+    tsfn_ = Napi::ThreadSafeFunction::New(
+        env, Napi::Function::New(env, [](const Napi::CallbackInfo&) {}),
+        "xapian parallel indexer", 0, 1);
+    // Only kept referenced while an add() or finish() is waiting.
+    tsfn_.Unref(env);
+    pipeline_ = std::make_unique<Pipeline>(
+        config, *db, db->get_mutex(), threads, capacity,
+        WritableDatabase::CommitEvery(info[2]), tsfn_, this);
+  }
+
+  // Only reached with no add() or finish() waiting, as the object is kept
+  // referenced until they settle. Records still queued are dropped; the
+  // threads may be busy with a commit, so rather than being joined here the
+  // pipeline frees itself once they are done, see Wake().
+  ~ParallelIndexer() {
+    if (pipeline_) {
+      pipeline_.release()->Orphan();
+    }
+  }
+
+  // Resolves once every record is queued. Records that don't fit wait on
+  // the main thread, in call order, and are queued as the builders make
+  // room, so no thread is ever blocked waiting for JS.
+  Napi::Value add(const Napi::CallbackInfo& info) {
+    auto env = info.Env();
+    if (!finishing_.empty()) {
+      auto deferred = Napi::Promise::Deferred::New(env);
+      deferred.Reject(
+          Napi::Error::New(env, "indexer is already finished").Value());
+      return deferred.Promise();
+    }
+    pending_.push_back(
+        {Indexer::ParseRecords(pipeline_->get_config(), info[0]), 0,
+         Napi::Promise::Deferred::New(env)});
+    auto promise = pending_.back().deferred.Promise();
+    Fill(env);
+    return promise;
+  }
+
+  // Resolves with the number of records written once every record added
+  // before it is written and committed.
+  Napi::Value finish(const Napi::CallbackInfo& info) {
+    auto env = info.Env();
+    finishing_.push_back(Napi::Promise::Deferred::New(env));
+    auto promise = finishing_.back().Promise();
+    Fill(env);
+    return promise;
+  }
+
+  static void Init(Napi::Env env, Napi::Object exports) {
+    Napi::HandleScope scope(env);
+    Napi::Function func = DefineClass(
+        env, "ParallelIndexer",
+        {
+            InstanceMethod("add", &ParallelIndexer::add),
+            InstanceMethod("finish", &ParallelIndexer::finish),
+        });
+    AddonData::SetConstructor<ParallelIndexer>(env, func);
+    exports.Set("ParallelIndexer", func);
+  }
+
+ private:
+  // Bounded queue of records -> builder threads -> in-order writer thread.
+  // All shared state is guarded by mutex_ and changes are signalled on cond_.
+  // The threads call Wake() when the main thread asked to hear about free
+  // space, on failure, once everything is written and once they have all
+  // returned.
+  class Pipeline {
+   public:
+    Pipeline(const Indexer::Config& config, Xapian::WritableDatabase db,
+             std::shared_ptr<std::mutex> db_mutex, size_t threads,
+             size_t capacity, Xapian::doccount commit_every,
+             Napi::ThreadSafeFunction tsfn, ParallelIndexer* owner)
+        : config_(config),
+          db_(db),
+          db_mutex_(db_mutex),
+          capacity_(capacity),
+          commit_every_(commit_every),
+          tsfn_(tsfn),
+          owner_(owner),
+          builders_(threads),
+          running_(threads + 1) {
+      for (size_t i = 0; i < threads; i++) {
+        threads_.emplace_back([this] {
+          Build();
+          Exit();
+        });
+      }
+      threads_.emplace_back([this] {
+        Write();
+        Exit();
+      });
+    }
+
+    const Indexer::Config& get_config() const { return config_; }
+
+    // Main thread only; null once the indexer has been garbage collected.
+    ParallelIndexer* owner() const { return owner_; }
+
+    // Stops the threads for an indexer which has gone, and has the pipeline
+    // freed on the main thread once they have returned.
+    void Orphan() {
+      owner_ = nullptr;
+      Fail("indexer was destroyed before finish()");
+      Wake();
+    }
+
+    bool Exited() {
+      std::lock_guard<std::mutex> lock(mutex_);
+      return running_ == 0;
+    }
+
+    // Frees an orphaned pipeline whose threads have all returned. Calls still
+    // queued are dropped, see ParallelIndexer::Wake().
+    static void Reap(Pipeline* pipeline) {
+      pipeline->Join();
+      auto tsfn = pipeline->tsfn_;
+      delete pipeline;
+      tsfn.Abort();
+    }
+
+    // Queues records from `next` on while there is room and returns the
+    // index of the first one left over, in which case Wake() is called once
+    // there is room again.
+    size_t Push(std::vector<Indexer::Record>& records, size_t next) {
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!error_.empty()) {
+          throw std::runtime_error(error_);
+        }
+        if (closed_) {
+          throw std::runtime_error("indexer is already finished");
+        }
+        for (; next < records.size() && queue_.size() < capacity_; next++) {
+          queue_.emplace_back(pushed_++, std::move(records[next]));
+        }
+        want_space_ = next < records.size();
+      }
+      cond_.notify_all();
+      return next;
+    }
+
+    // Lets the threads drain the queue; Wake() is called when they are done.
+    void Close() {
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        closed_ = true;
+      }
+      cond_.notify_all();
+    }
+
+    bool Done() {
+      std::lock_guard<std::mutex> lock(mutex_);
+      return done_;
+    }
+
+    // Once Done(), joins the threads and returns the number of records
+    // written, or throws the error which stopped the pipeline.
+    Xapian::doccount Finish() {
+      Join();
+      if (!error_.empty()) {
+        throw std::runtime_error(error_);
+      }
+      return written_;
+    }
+
+   private:
+    void Build() {
+      try {
+        auto tg = Indexer::NewTermGenerator(config_);
+        for (;;) {
+          std::pair<uint64_t, Indexer::Record> item;
+          bool wake = false;
+          {
+            std::unique_lock<std::mutex> lock(mutex_);
+            cond_.wait(lock, [this] {
+              return (!queue_.empty() && built_.size() < capacity_) ||
+                     (queue_.empty() && closed_) || !error_.empty();
+            });
+            if (!error_.empty() || queue_.empty()) {
+              break;
+            }
+            item = std::move(queue_.front());
+            queue_.pop_front();
+            wake = want_space_;
+            want_space_ = false;
+          }
+          cond_.notify_all();
+          if (wake) {
+            Wake();
+          }
+          auto doc = Indexer::BuildDocument(config_, tg, item.second);
+          {
+            std::lock_guard<std::mutex> lock(mutex_);
+            built_.emplace(item.first, std::move(doc));
+          }
+          cond_.notify_all();
+        }
+      } catch (Xapian::Error& err) {
+        Fail(XapianErrorMessage(err));
+      } catch (std::exception& err) {
+        Fail(err.what());
+      }
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        builders_--;
+      }
+      cond_.notify_all();
+    }
+
+    void Write() {
+      try {
+        for (;;) {
+          Xapian::Document doc;
+          {
+            std::unique_lock<std::mutex> lock(mutex_);
+            cond_.wait(lock, [this] {
+              return built_.count(written_) || builders_ == 0 ||
+                     !error_.empty();
+            });
+            auto it = built_.find(written_);
+            if (!error_.empty() || it == built_.end()) {
+              break;
+            }
+            doc = std::move(it->second);
+            built_.erase(it);
+          }
+          cond_.notify_all();
+          std::lock_guard<std::mutex> db_lock(*db_mutex_);
+          {
+            Metrics::Timer timer(Metrics::ADD_DOCUMENT);
+            db_.add_document(doc);
+          }
+          written_++;
+          if (commit_every_ > 0 && written_ % commit_every_ == 0) {
+            Metrics::Timer timer(Metrics::COMMIT);
+            db_.commit();
+          }
+        }
+        if (Failed()) {
+          return;
+        }
+        {
+          std::lock_guard<std::mutex> db_lock(*db_mutex_);
+          Metrics::Timer timer(Metrics::COMMIT);
+          db_.commit();
+        }
+        {
+          std::lock_guard<std::mutex> lock(mutex_);
+          done_ = true;
+        }
+        Wake();
+      } catch (Xapian::Error& err) {
+        Fail(XapianErrorMessage(err));
+      } catch (std::exception& err) {
+        Fail(err.what());
+      }
+    }
+
+    bool Failed() {
+      std::lock_guard<std::mutex> lock(mutex_);
+      return !error_.empty();
+    }
+
+    // Stops every thread, and tells the main thread so it can reject what
+    // is waiting.
+    void Fail(const std::string& error) {
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!error_.empty()) {
+          return;
+        }
+        error_ = error;
+        done_ = true;
+      }
+      cond_.notify_all();
+      Wake();
+    }
+
+    void Wake() { tsfn_.NonBlockingCall(this, ParallelIndexer::Wake); }
+
+    // Called by each thread as it returns.
+    void Exit() {
+      bool last;
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        last = --running_ == 0;
+      }
+      if (last) {
+        Wake();
+      }
+    }
+
+    void Join() {
+      std::lock_guard<std::mutex> join_lock(join_mutex_);
+      for (auto& thread : threads_) {
+        if (thread.joinable()) {
+          thread.join();
+        }
+      }
+    }
+
+    const Indexer::Config config_;
+    Xapian::WritableDatabase db_;
+    std::shared_ptr<std::mutex> db_mutex_;
+    const size_t capacity_;
+    const Xapian::doccount commit_every_;
+    Napi::ThreadSafeFunction tsfn_;
+    ParallelIndexer* owner_;
+
+    std::mutex join_mutex_;
+    std::mutex mutex_;
+    std::condition_variable cond_;
+    std::deque<std::pair<uint64_t, Indexer::Record>> queue_;
+    std::map<uint64_t, Xapian::Document> built_;
+    uint64_t pushed_ = 0;
+    // Only the writer thread advances written_; others read it after Join().
+    uint64_t written_ = 0;
+    size_t builders_;
+    size_t running_;
+    bool want_space_ = false;
+    bool closed_ = false;
+    // Set once the writer has committed, or on failure.
+    bool done_ = false;
+    std::string error_;
+    std::vector<std::thread> threads_;
+  };
+
+  // A call to add() whose records are not all queued yet.
+  struct Pending {
+    std::vector<Indexer::Record> records;
+    size_t next;
+    Napi::Promise::Deferred deferred;
+  };
+
+  // Queues as much of the pending records as fit, settling add() and
+  // finish() promises as they complete. Runs on the main thread only.
+  void Fill(Napi::Env env) {
+    while (!pending_.empty()) {
+      auto& pending = pending_.front();
+      try {
+        pending.next = pipeline_->Push(pending.records, pending.next);
+      } catch (std::exception& err) {
+        for (auto& rejected : pending_) {
+          rejected.deferred.Reject(Napi::Error::New(env, err.what()).Value());
+        }
+        pending_.clear();
+        break;
+      }
+      if (pending.next < pending.records.size()) {
+        break;
+      }
+      pending.deferred.Resolve(env.Undefined());
+      pending_.pop_front();
+    }
+    if (pending_.empty() && !finishing_.empty()) {
+      pipeline_->Close();
+      if (pipeline_->Done()) {
+        Settle(env);
+      }
+    }
+    bool waiting = !pending_.empty() || !finishing_.empty();
+    if (waiting) {
+      tsfn_.Ref(env);
+    } else {
+      tsfn_.Unref(env);
+    }
+    // The object isn't collected while its promises are outstanding.
+    if (waiting != referenced_) {
+      if (waiting) {
+        Ref();
+      } else {
+        Unref();
+      }
+      referenced_ = waiting;
+    }
+  }
+
+  void Settle(Napi::Env env) {
+    try {
+      auto written = Napi::Number::New(env, pipeline_->Finish());
+      for (auto& deferred : finishing_) {
+        deferred.Resolve(written);
+      }
+    } catch (std::exception& err) {
+      for (auto& deferred : finishing_) {
+        deferred.Reject(Napi::Error::New(env, err.what()).Value());
+      }
+    }
+    finishing_.clear();
+  }
+
+  static void Wake(Napi::Env env, Napi::Function, Pipeline* pipeline) {
+    if (env == nullptr) {
+      return;
+    }
+    if (auto indexer = pipeline->owner()) {
+      Napi::HandleScope scope(env);
+      indexer->Fill(env);
+    } else if (pipeline->Exited()) {
+      Pipeline::Reap(pipeline);
+    }
+  }
+
+  Napi::ThreadSafeFunction tsfn_;
+  std::unique_ptr<Pipeline> pipeline_;
+  std::deque<Pending> pending_;
+  std::vector<Napi::Promise::Deferred> finishing_;
+  bool referenced_ = false;
+};
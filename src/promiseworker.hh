@@ -0,0 +1,56 @@
+#pragma once
+
+#include <napi.h>
+#include <xapian.h>
+
+#include <exception>
+
+#include "exceptions.hh"
+
+// Base class for work that runs on the libuv threadpool and settles a
+// Promise. Subclasses implement Run() (worker thread, must not touch any
+// Napi values) and Result() (main thread, builds the resolved value).
+class PromiseWorker : public Napi::AsyncWorker {
+ public:
+  explicit PromiseWorker(Napi::Env env)
+      : Napi::AsyncWorker(env), deferred_(Napi::Promise::Deferred::New(env)) {}
+
+  Napi::Promise Promise() { return deferred_.Promise(); }
+
+ protected:
+  virtual void Run() = 0;
+  virtual Napi::Value Result(Napi::Env env) = 0;
+  // Main thread, before the promise settles either way.
+  virtual void Cleanup(Napi::Env env) {}
+
+  void Execute() final {
+    try {
+      Run();
+    } catch (Xapian::Error& err) {
+      SetError(XapianErrorMessage(err));
+    } catch (std::exception& err) {
+      SetError(err.what());
+    }
+  }
+
+  void OnOK() final {
+    try {
+      Cleanup(Env());
+      deferred_.Resolve(Result(Env()));
+    } catch (Napi::Error& err) {
+      deferred_.Reject(err.Value());
+    }
+  }
+
+  void OnError(const Napi::Error& err) final {
+    try {
+      Cleanup(Env());
+    } catch (Napi::Error&) {
+      // the work's own error is the one to report
+    }
+    deferred_.Reject(err.Value());
+  }
+
+ private:
+  Napi::Promise::Deferred deferred_;
+};
@@ -3,7 +3,13 @@
 #include <napi.h>
 #include <xapian.h>
 
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "addondata.hh"
 #include "database.hh"
+#include "document.hh"
 #include "exceptions.hh"
 
 class Query : public Napi::ObjectWrap<Query> {
@@ -13,12 +19,122 @@ class Query : public Napi::ObjectWrap<Query> {
       auto qPtr = reinterpret_cast<Xapian::Query*>(
           info[0].As<Napi::External<Xapian::Query>>().Data());
       query_ = *qPtr;
+    } else if (info.Length() > 0 && info[0].IsString()) {
+      // Query(term, wqf = 1, pos = 0)
+      Xapian::termcount wqf = 1;
+      Xapian::termpos pos = 0;
+      if (info.Length() > 1) {
+        wqf = info[1].ToNumber();
+      }
+      if (info.Length() > 2) {
+        pos = info[2].ToNumber();
+      }
+      query_ = TRY_CATCH_XAPIAN_CALLBACK_INFO(
+          Xapian::Query(info[0].ToString(), wqf, pos));
+    } else if (info.Length() > 0) {
+      query_ = TRY_CATCH_XAPIAN_CALLBACK_INFO(FromOp(info));
     }
   }
 
   static Napi::Object New(Napi::Env env, Xapian::Query query) {
     auto eQuery = Napi::External<decltype(query)>::New(env, &query);
-    return constructor.New({eQuery});
+    return AddonData::Constructor<Query>(env).New({eQuery});
+  }
+
+  // Accepts a Query object or a string, which is taken as a term.
+  static Xapian::Query ToQuery(const Napi::Value& value) {
+    if (value.IsString()) {
+      return Xapian::Query(value.ToString());
+    }
+    return *Napi::ObjectWrap<Query>::Unwrap(value.As<Napi::Object>());
+  }
+
+  // Numbers are sortable_serialise()d to match how Indexer stores them.
+  static std::string ToValue(const Napi::Value& value) {
+    if (value.IsNumber()) {
+      return Xapian::sortable_serialise(value.As<Napi::Number>().DoubleValue());
+    }
+    return Document::ToBytes(value);
+  }
+
+  static Napi::Value value_range(const Napi::CallbackInfo& info) {
+    auto query = TRY_CATCH_XAPIAN_CALLBACK_INFO(
+        Xapian::Query(Xapian::Query::OP_VALUE_RANGE,
+                      info[0].ToNumber().Uint32Value(), ToValue(info[1]),
+                      ToValue(info[2])));
+    return New(info.Env(), query);
+  }
+
+  // Leaf queries weighting each document by a value slot, for static
+  // boosts; values are read as sortable_serialise()d numbers. Each match
+  // clones the source, so one Query can be used by concurrent matches.
+  static Napi::Value value_weight_posting_source(
+      const Napi::CallbackInfo& info) {
+    Xapian::valueno slot = info[0].ToNumber();
+    auto query = TRY_CATCH_XAPIAN_CALLBACK_INFO(Xapian::Query(
+        (new Xapian::ValueWeightPostingSource(slot))->release()));
+    return New(info.Env(), query);
+  }
+
+  // Assumes the value decreases with docid over [range_start, range_end],
+  // which lets the matcher stop early.
+  static Napi::Value decreasing_value_weight_posting_source(
+      const Napi::CallbackInfo& info) {
+    Xapian::valueno slot = info[0].ToNumber();
+    Xapian::docid range_start = 0;
+    Xapian::docid range_end = 0;
+    if (info.Length() > 1) {
+      range_start = info[1].ToNumber();
+    }
+    if (info.Length() > 2) {
+      range_end = info[2].ToNumber();
+    }
+    auto query = TRY_CATCH_XAPIAN_CALLBACK_INFO(
+        Xapian::Query((new Xapian::DecreasingValueWeightPostingSource(
+                           slot, range_start, range_end))
+                          ->release()));
+    return New(info.Env(), query);
+  }
+
+  // valueMapPostingSource(slot, {[value]: weight}, default_weight = 0)
+  static Napi::Value value_map_posting_source(const Napi::CallbackInfo& info) {
+    auto env = info.Env();
+    Xapian::valueno slot = info[0].ToNumber();
+    if (!info[1].IsObject()) {
+      throw Napi::Error::New(env, "second argument must be a weight map");
+    }
+    auto source = new Xapian::ValueMapPostingSource(slot);
+    // Owned by the Query once released, so free it on a bad argument.
+    std::unique_ptr<Xapian::ValueMapPostingSource> owner(source);
+    auto map = info[1].As<Napi::Object>();
+    auto keys = map.GetPropertyNames();
+    for (uint32_t i = 0; i < keys.Length(); i++) {
+      auto key = keys.Get(i);
+      TRY_CATCH_XAPIAN(env, source->add_mapping(
+                                key.ToString(),
+                                map.Get(key).ToNumber().DoubleValue()));
+    }
+    if (info.Length() > 2) {
+      TRY_CATCH_XAPIAN(env, source->set_default_weight(
+                                info[2].ToNumber().DoubleValue()));
+    }
+    auto query = TRY_CATCH_XAPIAN(
+        env, Xapian::Query(owner.release()->release()));
+    return New(env, query);
+  }
+
+  static Napi::Value unserialise(const Napi::CallbackInfo& info) {
+    auto query = TRY_CATCH_XAPIAN_CALLBACK_INFO(
+        Xapian::Query::unserialise(Document::ToBytes(info[0])));
+    return New(info.Env(), query);
+  }
+
+  Napi::Value get_length(const Napi::CallbackInfo& info) {
+    return Napi::Number::New(info.Env(), query_.get_length());
+  }
+
+  Napi::Value serialise_buffer(const Napi::CallbackInfo& info) {
+    return Document::ToBuffer(info.Env(), query_.serialise());
   }
 
   Napi::Value empty(const Napi::CallbackInfo& info) {
@@ -35,6 +151,10 @@ class Query : public Napi::ObjectWrap<Query> {
 
   operator const Xapian::Query&() { return query_; }
 
+  // Time QueryParser took to produce this query, reported by MSet.stats.
+  double parse_ms() const { return parse_ms_; }
+  void set_parse_ms(double parse_ms) { parse_ms_ = parse_ms; }
+
   static void Init(Napi::Env env, Napi::Object exports) {
     Napi::HandleScope scope(env);
     Napi::Function func = DefineClass(
@@ -42,7 +162,18 @@ class Query : public Napi::ObjectWrap<Query> {
         {
             InstanceMethod("empty", &Query::empty),
             InstanceMethod("serialise", &Query::serialise),
+            InstanceMethod("serialise_buffer", &Query::serialise_buffer),
+            InstanceMethod("get_length", &Query::get_length),
             InstanceMethod("get_description", &Query::get_description),
+            InstanceMethod("toString", &Query::get_description),
+            StaticMethod("valueRange", &Query::value_range),
+            StaticMethod("unserialise", &Query::unserialise),
+            StaticMethod("valueWeightPostingSource",
+                         &Query::value_weight_posting_source),
+            StaticMethod("decreasingValueWeightPostingSource",
+                         &Query::decreasing_value_weight_posting_source),
+            StaticMethod("valueMapPostingSource",
+                         &Query::value_map_posting_source),
 
             // constants
             StaticValue("OP_AND",
@@ -88,15 +219,83 @@ class Query : public Napi::ObjectWrap<Query> {
             StaticValue(
                 "LEAF_MATCH_NOTHING",
                 Napi::Number::New(env, Xapian::Query::LEAF_MATCH_NOTHING)),
+            StaticValue(
+                "WILDCARD_LIMIT_ERROR",
+                Napi::Number::New(env, Xapian::Query::WILDCARD_LIMIT_ERROR)),
+            StaticValue(
+                "WILDCARD_LIMIT_FIRST",
+                Napi::Number::New(env, Xapian::Query::WILDCARD_LIMIT_FIRST)),
+            StaticValue("WILDCARD_LIMIT_MOST_FREQUENT",
+                        Napi::Number::New(
+                            env, Xapian::Query::WILDCARD_LIMIT_MOST_FREQUENT)),
 
         });
-    constructor = Napi::Persistent(func);
-    constructor.SuppressDestruct();
+    AddonData::SetConstructor<Query>(env, func);
+    func.Set("matchAll", New(env, Xapian::Query::MatchAll));
+    func.Set("matchNothing", New(env, Xapian::Query::MatchNothing));
     exports.Set("Query", func);
   }
 
  private:
-  inline static Napi::FunctionReference constructor;
+  // Query(op, ...) with the arguments each operator takes in Xapian:
+  //   OP_SCALE_WEIGHT: (op, subquery, factor)
+  //   OP_VALUE_RANGE:  (op, slot, begin, end)
+  //   OP_VALUE_GE/LE:  (op, slot, limit)
+  //   OP_WILDCARD:     (op, pattern, max_expansion = 0,
+  //                     max_type = WILDCARD_LIMIT_ERROR, combiner = OP_SYNONYM)
+  //   otherwise:       (op, subqueries: (Query | string)[], parameter = 0)
+  static Xapian::Query FromOp(const Napi::CallbackInfo& info) {
+    auto env = info.Env();
+    auto op = static_cast<Xapian::Query::op>(info[0].ToNumber().Int32Value());
+    switch (op) {
+      case Xapian::Query::OP_SCALE_WEIGHT:
+        return Xapian::Query(op, ToQuery(info[1]),
+                             info[2].ToNumber().DoubleValue());
+      case Xapian::Query::OP_VALUE_RANGE:
+        return Xapian::Query(op, info[1].ToNumber().Uint32Value(),
+                             ToValue(info[2]), ToValue(info[3]));
+      case Xapian::Query::OP_VALUE_GE:
+      case Xapian::Query::OP_VALUE_LE:
+        return Xapian::Query(op, info[1].ToNumber().Uint32Value(),
+                             ToValue(info[2]));
+      case Xapian::Query::OP_WILDCARD: {
+        Xapian::termcount max_expansion = 0;
+        int max_type = Xapian::Query::WILDCARD_LIMIT_ERROR;
+        auto combiner = Xapian::Query::OP_SYNONYM;
+        if (info.Length() > 2) {
+          max_expansion = info[2].ToNumber();
+        }
+        if (info.Length() > 3) {
+          max_type = info[3].ToNumber();
+        }
+        if (info.Length() > 4) {
+          combiner =
+              static_cast<Xapian::Query::op>(info[4].ToNumber().Int32Value());
+        }
+        return Xapian::Query(op, info[1].ToString(), max_expansion, max_type,
+                             combiner);
+      }
+      default: {
+        if (!info[1].IsArray()) {
+          throw Napi::Error::New(env, "subqueries must be an array");
+        }
+        auto arr = info[1].As<Napi::Array>();
+        std::vector<Xapian::Query> subqueries;
+        subqueries.reserve(arr.Length());
+        for (uint32_t i = 0; i < arr.Length(); i++) {
+          subqueries.push_back(ToQuery(arr.Get(i)));
+        }
+        Xapian::termcount parameter = 0;
+        if (info.Length() > 2) {
+          parameter = info[2].ToNumber();
+        }
+        return Xapian::Query(op, subqueries.begin(), subqueries.end(),
+                             parameter);
+      }
+    }
+  }
+
   Xapian::Query query_;
+  double parse_ms_ = 0;
 };
 
@@ -3,9 +3,18 @@
 #include <napi.h>
 #include <xapian.h>
 
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include "addondata.hh"
 #include "database.hh"
 #include "exceptions.hh"
+#include "lrucache.hh"
+#include "metrics.hh"
 #include "query.hh"
+#include "stats.hh"
 #include "stem.hh"
 
 class QueryParser : public Napi::ObjectWrap<QueryParser> {
@@ -16,17 +25,20 @@ class QueryParser : public Napi::ObjectWrap<QueryParser> {
   void set_stemmer(const Napi::CallbackInfo& info) {
     Stem* stemmer = Napi::ObjectWrap<Stem>::Unwrap(info[0].As<Napi::Object>());
     TRY_CATCH_XAPIAN_CALLBACK_INFO(qp_.set_stemmer(*stemmer));
+    cache_.clear();
   }
 
   void set_stemming_strategy(const Napi::CallbackInfo& info) {
     TRY_CATCH_XAPIAN_CALLBACK_INFO(qp_.set_stemming_strategy(
         static_cast<Xapian::QueryParser::stem_strategy>(
             info[0].ToNumber().Int32Value())));
+    cache_.clear();
   }
 
   void set_default_op(const Napi::CallbackInfo& info) {
     TRY_CATCH_XAPIAN_CALLBACK_INFO(qp_.set_default_op(
         static_cast<Xapian::Query::op>(info[0].ToNumber().Int32Value())));
+    cache_.clear();
   }
 
   Napi::Value get_default_op(const Napi::CallbackInfo& info) {
@@ -37,7 +49,16 @@ class QueryParser : public Napi::ObjectWrap<QueryParser> {
   void set_database(const Napi::CallbackInfo& info) {
     auto obj = info[0].As<Napi::Object>();
     Database* db = Napi::ObjectWrap<Database>::Unwrap(obj);
-    TRY_CATCH_XAPIAN_CALLBACK_INFO(qp_.set_database(*db));
+    {
+      std::lock_guard<std::mutex> lock(*db->get_mutex());
+      TRY_CATCH_XAPIAN_CALLBACK_INFO(qp_.set_database(*db));
+    }
+    database_ = Napi::Persistent(obj);
+    db_mutex_ = db->get_mutex();
+    db_generation_ = db->get_generation();
+    cache_generation_ = *db_generation_;
+    synced_generation_ = *db_generation_;
+    cache_.clear();
   }
 
   void set_max_expansion(const Napi::CallbackInfo& info) {
@@ -49,9 +70,12 @@ class QueryParser : public Napi::ObjectWrap<QueryParser> {
     } else {
       qp_.set_max_expansion(info[0].ToNumber());
     }
+    cache_.clear();
   }
 
   Napi::Value parse_query(const Napi::CallbackInfo& info) {
+    Metrics::Timer timer(Metrics::PARSE_QUERY);
+    auto start = std::chrono::steady_clock::now();
     uint32_t flags = Xapian::QueryParser::FLAG_DEFAULT;
     std::string default_prefix;
     if (info.Length() > 1) {
@@ -60,23 +84,79 @@ class QueryParser : public Napi::ObjectWrap<QueryParser> {
     if (info.Length() > 2) {
       default_prefix = info[2].ToString();
     }
+    std::string query_string = info[0].ToString();
+
+    std::string key;
+    if (cache_.enabled()) {
+      if (db_generation_ && *db_generation_ != cache_generation_) {
+        cache_.clear();
+        cache_generation_ = *db_generation_;
+      }
+      key = std::to_string(flags) + ':' + default_prefix + '\0' + query_string;
+      if (auto cached = cache_.get(key)) {
+        corrected_ = cached->corrected;
+        return NewQuery(info.Env(), cached->query, start);
+      }
+    }
 
-    auto query = qp_.parse_query(info[0].ToString(), flags, default_prefix);
-    return Query::New(info.Env(), query);
+    // Wildcard and spelling expansion read the database.
+    std::unique_lock<std::mutex> lock;
+    if (db_mutex_) {
+      lock = std::unique_lock<std::mutex>(*db_mutex_);
+      // qp_ holds its own copy of the database handle, which doesn't see
+      // shards added to the Database since.
+      if (*db_generation_ != synced_generation_) {
+        TRY_CATCH_XAPIAN_CALLBACK_INFO(qp_.set_database(
+            *Napi::ObjectWrap<Database>::Unwrap(database_.Value())));
+        synced_generation_ = *db_generation_;
+      }
+    }
+    auto query = TRY_CATCH_XAPIAN_CALLBACK_INFO(
+        qp_.parse_query(query_string, flags, default_prefix));
+    corrected_ = qp_.get_corrected_query_string();
+    cache_.put(key, Parsed{query, corrected_},
+               key.size() + corrected_.size() +
+                   query.get_length() * kCachedTermBytes);
+    return NewQuery(info.Env(), query, start);
   }
 
   void add_prefix(const Napi::CallbackInfo& info) {
     qp_.add_prefix(info[0].ToString(), info[1].ToString());
+    cache_.clear();
   }
 
   void add_boolean_prefix(const Napi::CallbackInfo& info) {
     qp_.add_boolean_prefix(info[0].ToString(), info[1].ToString());
+    cache_.clear();
   }
 
   Napi::Value get_corrected_query_string(const Napi::CallbackInfo& info) {
-    return Napi::String::New(info.Env(), qp_.get_corrected_query_string());
+    return Napi::String::New(info.Env(), corrected_);
+  }
+
+  void set_cache(const Napi::CallbackInfo& info) {
+    size_t max_entries = 1000;
+    size_t max_bytes = 0;
+    if (info.Length() > 0 && info[0].IsObject()) {
+      auto opts = info[0].As<Napi::Object>();
+      if (opts.Has("maxEntries")) {
+        max_entries = opts.Get("maxEntries").ToNumber().Int64Value();
+      }
+      if (opts.Has("maxBytes")) {
+        max_bytes = opts.Get("maxBytes").ToNumber().Int64Value();
+      }
+    } else if (info.Length() > 0 && !info[0].ToBoolean()) {
+      max_entries = 0;
+    }
+    cache_.resize(max_entries, max_bytes);
   }
 
+  Napi::Value get_cache_stats(const Napi::CallbackInfo& info) {
+    return cache_.stats(info.Env());
+  }
+
+  void clear_cache(const Napi::CallbackInfo& info) { cache_.clear(); }
+
   Napi::Value get_description(const Napi::CallbackInfo& info) {
     return Napi::String::New(info.Env(), qp_.get_description());
   }
@@ -101,6 +181,9 @@ class QueryParser : public Napi::ObjectWrap<QueryParser> {
             InstanceMethod("get_corrected_query_string",
                            &QueryParser::get_corrected_query_string),
             InstanceMethod("get_description", &QueryParser::get_description),
+            InstanceMethod("set_cache", &QueryParser::set_cache),
+            InstanceMethod("get_cache_stats", &QueryParser::get_cache_stats),
+            InstanceMethod("clear_cache", &QueryParser::clear_cache),
 
             // constants
             StaticValue("STEM_NONE",
@@ -117,13 +200,37 @@ class QueryParser : public Napi::ObjectWrap<QueryParser> {
                             env, Xapian::QueryParser::STEM_SOME_FULL_POS)),
 
         });
-    constructor = Napi::Persistent(func);
-    constructor.SuppressDestruct();
+    AddonData::SetConstructor<QueryParser>(env, func);
     exports.Set("QueryParser", func);
   }
 
  private:
-  inline static Napi::FunctionReference constructor;
+  static Napi::Object NewQuery(Napi::Env env, const Xapian::Query& query,
+                               std::chrono::steady_clock::time_point start) {
+    auto obj = Query::New(env, query);
+    auto query_obj = Napi::ObjectWrap<Query>::Unwrap(obj);
+    query_obj->set_parse_ms(MillisecondsSince(start));
+    return obj;
+  }
+
+  struct Parsed {
+    Xapian::Query query;
+    std::string corrected;
+  };
+
+  // Rough size of one term in a parsed Xapian::Query, used for maxBytes.
+  static constexpr size_t kCachedTermBytes = 64;
+
   Xapian::QueryParser qp_;
+  // Parsed queries keyed on (flags, default_prefix, query string). Cleared
+  // by every setter which changes how strings parse, and when the database
+  // used for wildcard and spelling expansion is reopened.
+  LruCache<Parsed> cache_;
+  std::shared_ptr<std::mutex> db_mutex_;
+  Napi::ObjectReference database_;
+  std::shared_ptr<uint64_t> db_generation_;
+  uint64_t cache_generation_ = 0;
+  uint64_t synced_generation_ = 0;
+  std::string corrected_;
 };
 
@@ -0,0 +1,399 @@
+#pragma once
+
+#include <napi.h>
+#include <xapian.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "addondata.hh"
+#include "database.hh"
+#include "exceptions.hh"
+#include "promiseworker.hh"
+#include "query.hh"
+#include "shareddatabase.hh"
+
+// Runs one query against independent shard databases, each on its own
+// thread, and merges the top hits. Global docids follow Xapian's
+// multi-database numbering, so they agree with a Database opened on every
+// shard's paths in the same order.
+class ShardedSearcher : public Napi::ObjectWrap<ShardedSearcher> {
+ public:
+  ShardedSearcher(const Napi::CallbackInfo& info)
+      : Napi::ObjectWrap<ShardedSearcher>(info) {
+    auto env = info.Env();
+    Napi::HandleScope scope(env);
+
+    if (info.Length() < 1 || !info[0].IsArray()) {
+      throw Napi::Error::New(env, "first argument must be an array of shards");
+    }
+    auto arr = info[0].As<Napi::Array>();
+    auto max_readers = SharedDatabase::MaxReaders(info[1]);
+    for (uint32_t i = 0; i < arr.Length(); i++) {
+      shards_.push_back(OpenShard(env, arr.Get(i), max_readers));
+    }
+    if (shards_.empty()) {
+      throw Napi::Error::New(env, "at least one shard is required");
+    }
+    // A shard may itself hold several databases, each of which takes its
+    // own place in the docid interleave.
+    for (auto& shard : shards_) {
+      layout_.offsets.push_back(layout_.total);
+      layout_.sizes.push_back(shard->size());
+      layout_.total += layout_.sizes.back();
+    }
+    pool_ = std::make_shared<Pool>(shards_.size() - 1);
+  }
+
+  Napi::Value search(const Napi::CallbackInfo& info) {
+    auto env = info.Env();
+    if (info.Length() < 3) {
+      throw Napi::Error::New(env, "query, first and maxitems are required");
+    }
+    Search search;
+    search.query = TRY_CATCH_XAPIAN(env, Query::ToQuery(info[0]).serialise());
+    search.first = info[1].ToNumber();
+    search.maxitems = info[2].ToNumber();
+    if (info[3].IsObject()) {
+      auto opts = info[3].As<Napi::Object>();
+      if (opts.Has("sortBy")) {
+        search.sort_slot = opts.Get("sortBy").ToNumber();
+      }
+      if (opts.Has("reverse")) {
+        search.sort_reverse = opts.Get("reverse").ToBoolean();
+      }
+      if (opts.Has("checkatleast")) {
+        search.checkatleast = opts.Get("checkatleast").ToNumber();
+      }
+      if (opts.Has("data")) {
+        search.data = opts.Get("data").ToBoolean();
+      }
+    }
+    auto worker = new SearchWorker(env, shards_, layout_, pool_, search);
+    worker->Queue();
+    return worker->Promise();
+  }
+
+  // Reopens every shard at its latest revision; true if any changed.
+  Napi::Value reopen(const Napi::CallbackInfo& info) {
+    bool changed = false;
+    for (auto& shard : shards_) {
+      changed |= TRY_CATCH_XAPIAN_CALLBACK_INFO(shard->Reopen());
+    }
+    return Napi::Boolean::New(info.Env(), changed);
+  }
+
+  Napi::Value get_shard_count(const Napi::CallbackInfo& info) {
+    return Napi::Number::New(info.Env(), shards_.size());
+  }
+
+  static void Init(Napi::Env env, Napi::Object exports) {
+    Napi::HandleScope scope(env);
+    Napi::Function func = DefineClass(
+        env, "ShardedSearcher",
+        {
+            InstanceMethod("search", &ShardedSearcher::search),
+            InstanceMethod("reopen", &ShardedSearcher::reopen),
+            InstanceMethod("get_shard_count",
+                           &ShardedSearcher::get_shard_count),
+            InstanceAccessor("shard_count", &ShardedSearcher::get_shard_count,
+                             nullptr),
+        });
+    AddonData::SetConstructor<ShardedSearcher>(env, func);
+    exports.Set("ShardedSearcher", func);
+  }
+
+ private:
+  // Each shard has its own pool of readers, so shards are searched in
+  // parallel without sharing any Xapian object between threads.
+  using Shard = SharedDatabase::Handle;
+
+  struct Search {
+    // Serialised so that each thread unserialises a private copy; Xapian's
+    // reference counts are not atomic.
+    std::string query;
+    Xapian::doccount first = 0;
+    Xapian::doccount maxitems = 10;
+    Xapian::doccount checkatleast = 0;
+    Xapian::valueno sort_slot = Xapian::BAD_VALUENO;
+    bool sort_reverse = false;
+    bool data = false;
+  };
+
+  struct Hit {
+    Xapian::docid docid;
+    uint32_t shard;
+    Xapian::docid shard_docid;
+    double weight;
+    std::string sort_key;
+    std::string data;
+  };
+
+  // Where each shard's databases sit in the global docid interleave.
+  struct Layout {
+    std::vector<Xapian::doccount> offsets;
+    std::vector<Xapian::doccount> sizes;
+    Xapian::doccount total = 0;
+
+    Xapian::docid GlobalDocid(uint32_t index, Xapian::docid shard_docid) const {
+      auto size = sizes[index];
+      auto sub = (shard_docid - 1) % size;
+      auto local = (shard_docid - 1) / size;
+      return local * total + offsets[index] + sub + 1;
+    }
+  };
+
+  // Threads kept for the searcher's lifetime, which match the shards after
+  // the first; the worker thread running the search matches the first.
+  class Pool {
+   public:
+    explicit Pool(size_t threads) {
+      try {
+        for (size_t i = 0; i < threads; i++) {
+          threads_.emplace_back(&Pool::Work, this);
+        }
+      } catch (...) {
+        Stop();
+        throw;
+      }
+    }
+
+    ~Pool() { Stop(); }
+
+    void Post(std::function<void()> task) {
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        tasks_.push_back(std::move(task));
+      }
+      cond_.notify_one();
+    }
+
+   private:
+    void Work() {
+      for (;;) {
+        std::function<void()> task;
+        {
+          std::unique_lock<std::mutex> lock(mutex_);
+          cond_.wait(lock, [this] { return !tasks_.empty() || stopping_; });
+          if (tasks_.empty()) {
+            return;
+          }
+          task = std::move(tasks_.front());
+          tasks_.pop_front();
+        }
+        task();
+      }
+    }
+
+    void Stop() {
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+      }
+      cond_.notify_all();
+      for (auto& thread : threads_) {
+        thread.join();
+      }
+    }
+
+    std::mutex mutex_;
+    std::condition_variable cond_;
+    std::deque<std::function<void()>> tasks_;
+    bool stopping_ = false;
+    std::vector<std::thread> threads_;
+  };
+
+  struct ShardResult {
+    std::vector<Hit> hits;
+    Xapian::doccount estimated = 0;
+    Xapian::doccount lower_bound = 0;
+    Xapian::doccount upper_bound = 0;
+    std::string error;
+  };
+
+  static std::shared_ptr<Shard> OpenShard(Napi::Env env,
+                                          const Napi::Value& value,
+                                          size_t max_readers) {
+    if (SharedDatabase::IsSharedDatabase(value)) {
+      return Napi::ObjectWrap<SharedDatabase>::Unwrap(value.As<Napi::Object>())
+          ->handle();
+    }
+    std::vector<std::pair<std::string, int>> paths;
+    if (value.IsString()) {
+      paths.emplace_back(value.ToString(), 0);
+    } else if (value.IsObject() &&
+               value.As<Napi::Object>().InstanceOf(
+                   AddonData::Constructor<Database>(env).Value())) {
+      paths = Napi::ObjectWrap<Database>::Unwrap(value.As<Napi::Object>())
+                  ->shards();
+    } else {
+      throw Napi::TypeError::New(
+          env, "shards must be paths, Databases or SharedDatabases");
+    }
+    if (paths.empty()) {
+      throw Napi::Error::New(
+          env, "shards must be paths or Databases opened from paths");
+    }
+    return TRY_CATCH_XAPIAN(
+        env, std::make_shared<Shard>(std::move(paths), max_readers));
+  }
+
+  // Both orders put the better hit first.
+  static bool Before(const Search& search, const Hit& a, const Hit& b) {
+    if (search.sort_slot != Xapian::BAD_VALUENO && a.sort_key != b.sort_key) {
+      return search.sort_reverse ? a.sort_key > b.sort_key
+                                 : a.sort_key < b.sort_key;
+    }
+    if (a.weight != b.weight) {
+      return a.weight > b.weight;
+    }
+    return a.docid < b.docid;
+  }
+
+  static void SearchShard(const Search& search, Shard& shard,
+                          const Layout& layout, uint32_t index,
+                          ShardResult& result) {
+    try {
+      // Declared first so the reader is handed back after every Xapian
+      // object using it is gone.
+      auto lease = shard.Acquire();
+      Xapian::Enquire enquire(lease.db());
+      enquire.set_query(Xapian::Query::unserialise(search.query));
+      if (search.sort_slot != Xapian::BAD_VALUENO) {
+        enquire.set_sort_by_value_then_relevance(search.sort_slot,
+                                                 search.sort_reverse);
+      }
+      // Any shard may hold every hit of the requested page.
+      auto mset = enquire.get_mset(0, search.first + search.maxitems,
+                                   search.checkatleast);
+      result.estimated = mset.get_matches_estimated();
+      result.lower_bound = mset.get_matches_lower_bound();
+      result.upper_bound = mset.get_matches_upper_bound();
+      for (auto it = mset.begin(); it != mset.end(); it++) {
+        Hit hit;
+        hit.shard_docid = *it;
+        hit.docid = layout.GlobalDocid(index, hit.shard_docid);
+        hit.shard = index;
+        hit.weight = it.get_weight();
+        if (search.sort_slot != Xapian::BAD_VALUENO) {
+          hit.sort_key = it.get_sort_key();
+        }
+        if (search.data) {
+          hit.data = it.get_document().get_data();
+        }
+        result.hits.push_back(std::move(hit));
+      }
+    } catch (Xapian::Error& err) {
+      result.error = XapianErrorMessage(err);
+    } catch (std::exception& err) {
+      result.error = err.what();
+    }
+  }
+
+  class SearchWorker : public PromiseWorker {
+   public:
+    SearchWorker(Napi::Env env, std::vector<std::shared_ptr<Shard>> shards,
+                 const Layout& layout, std::shared_ptr<Pool> pool,
+                 Search search)
+        : PromiseWorker(env),
+          shards_(std::move(shards)),
+          layout_(layout),
+          pool_(std::move(pool)),
+          search_(std::move(search)) {}
+
+   protected:
+    void Run() override {
+      uint32_t count = shards_.size();
+      std::vector<ShardResult> results(count);
+      std::mutex mutex;
+      std::condition_variable cond;
+      uint32_t remaining = count - 1;
+      for (uint32_t i = 1; i < count; i++) {
+        pool_->Post([&, i] {
+          SearchShard(search_, *shards_[i], layout_, i, results[i]);
+          {
+            std::lock_guard<std::mutex> lock(mutex);
+            remaining--;
+          }
+          cond.notify_one();
+        });
+      }
+      SearchShard(search_, *shards_[0], layout_, 0, results[0]);
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        cond.wait(lock, [&] { return remaining == 0; });
+      }
+
+      for (auto& result : results) {
+        if (!result.error.empty()) {
+          throw std::runtime_error(result.error);
+        }
+        estimated_ += result.estimated;
+        lower_bound_ += result.lower_bound;
+        upper_bound_ += result.upper_bound;
+        std::move(result.hits.begin(), result.hits.end(),
+                  std::back_inserter(hits_));
+      }
+      size_t end = std::min<size_t>(hits_.size(),
+                                    search_.first + search_.maxitems);
+      std::partial_sort(hits_.begin(), hits_.begin() + end, hits_.end(),
+                        [this](const Hit& a, const Hit& b) {
+                          return Before(search_, a, b);
+                        });
+      hits_.resize(end);
+    }
+
+    Napi::Value Result(Napi::Env env) override {
+      auto hits = Napi::Array::New(env);
+      uint32_t rank = search_.first;
+      for (size_t i = search_.first; i < hits_.size(); i++, rank++) {
+        auto& hit = hits_[i];
+        auto obj = Napi::Object::New(env);
+        obj.Set("docid", hit.docid);
+        obj.Set("shard", hit.shard);
+        obj.Set("shard_docid", hit.shard_docid);
+        obj.Set("weight", hit.weight);
+        obj.Set("rank", rank);
+        if (search_.sort_slot != Xapian::BAD_VALUENO) {
+          obj.Set("sort_key", hit.sort_key);
+        }
+        if (search_.data) {
+          obj.Set("data", hit.data);
+        }
+        hits.Set(i - search_.first, obj);
+      }
+      auto res = Napi::Object::New(env);
+      res.Set("matches_estimated", estimated_);
+      res.Set("matches_lower_bound", lower_bound_);
+      res.Set("matches_upper_bound", upper_bound_);
+      res.Set("hits", hits);
+      return res;
+    }
+
+   private:
+    std::vector<std::shared_ptr<Shard>> shards_;
+    const Layout layout_;
+    std::shared_ptr<Pool> pool_;
+    Search search_;
+    std::vector<Hit> hits_;
+    Xapian::doccount estimated_ = 0;
+    Xapian::doccount lower_bound_ = 0;
+    Xapian::doccount upper_bound_ = 0;
+  };
+
+  std::vector<std::shared_ptr<Shard>> shards_;
+  Layout layout_;
+  // Shared with running searches, so it outlives a collected searcher.
+  std::shared_ptr<Pool> pool_;
+};
@@ -0,0 +1,367 @@
+#pragma once
+
+#include <napi.h>
+#include <xapian.h>
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "addondata.hh"
+#include "exceptions.hh"
+
+// A read-only database opened once per process and used from any number of
+// worker_threads. Threads pass around a numeric handle; each SharedDatabase
+// object attached to it holds a reference, and the database is closed when
+// the last one is garbage collected.
+//
+// Xapian objects are neither thread-safe nor atomically reference counted,
+// so no Xapian::Database ever leaves its Handle: every method leases one of
+// the handle's readers and copies plain values out. Searching goes through
+// ShardedSearcher, which keeps the same rule.
+class SharedDatabase : public Napi::ObjectWrap<SharedDatabase> {
+ public:
+  // Up to `max_readers` readers, each opened on its own so that threads
+  // never share a Xapian object and only wait for one another once every
+  // reader is in use. Readers are opened as they are first needed.
+  class Handle {
+    struct Reader {
+      Xapian::Database db;
+      // Each shard of `db` on its own, see Revision().
+      std::vector<Xapian::Database> parts;
+      // Held by whoever uses `db`, and by the main thread while it reads an
+      // MSet matched on it, see LockedMSet.
+      std::shared_ptr<std::mutex> mutex = std::make_shared<std::mutex>();
+      // The reopen() the reader was last brought up to.
+      uint64_t generation = 0;
+      // Opened past the limit for a caller which can't wait, and closed
+      // again once it is handed back.
+      bool temporary = false;
+    };
+
+   public:
+    Handle(std::vector<std::pair<std::string, int>> shards,
+           size_t max_readers)
+        : shards_(std::move(shards)),
+          max_readers_(std::max<size_t>(1, max_readers)) {
+      idle_.push_back(Open());
+      opened_ = 1;
+    }
+
+    // Exclusive use of one reader, with its mutex held, handed back when
+    // the lease is destroyed.
+    class Lease {
+     public:
+      Lease(Lease&& other) = default;
+      ~Lease() {
+        if (reader_) {
+          handle_.Release(std::move(reader_));
+        }
+      }
+      Xapian::Database& db() { return reader_->db; }
+      const std::shared_ptr<std::mutex>& mutex() const { return mutex_; }
+      std::string revision() const { return Revision(reader_->parts); }
+
+     private:
+      friend class Handle;
+      Lease(Handle& handle, std::unique_ptr<Reader> reader)
+          : handle_(handle),
+            reader_(std::move(reader)),
+            mutex_(reader_->mutex),
+            lock_(*mutex_) {}
+
+      Handle& handle_;
+      std::unique_ptr<Reader> reader_;
+      // Unlocked only once the reader is back, or closed if temporary.
+      std::shared_ptr<std::mutex> mutex_;
+      std::unique_lock<std::mutex> lock_;
+    };
+
+    // Takes an idle reader, or opens another while there are fewer than the
+    // limit, and brings it up to the last reopen(). Once every reader is in
+    // use, threadpool work waits for one; the main thread passes `wait` =
+    // false and gets a temporary reader instead, so it never blocks on a
+    // running search.
+    Lease Acquire(bool wait = true) {
+      std::unique_ptr<Reader> reader;
+      bool open = false;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        if (wait) {
+          cond_.wait(lock, [this] {
+            return !idle_.empty() || opened_ < max_readers_;
+          });
+        }
+        if (!idle_.empty()) {
+          reader = std::move(idle_.back());
+          idle_.pop_back();
+        } else if (opened_ < max_readers_) {
+          opened_++;
+          open = true;
+        }
+      }
+      if (!reader) {
+        try {
+          reader = Open();
+        } catch (...) {
+          if (open) {
+            {
+              std::lock_guard<std::mutex> lock(mutex_);
+              opened_--;
+            }
+            cond_.notify_one();
+          }
+          throw;
+        }
+        reader->temporary = !open;
+      }
+      Lease lease(*this, std::move(reader));
+      uint64_t generation = generation_;
+      if (lease.reader_->generation != generation) {
+        lease.reader_->db.reopen();
+        lease.reader_->generation = generation;
+      }
+      return lease;
+    }
+
+    // Reopens one reader now and the rest when they are next leased; true
+    // if the database had changed.
+    bool Reopen() {
+      auto lease = Acquire(false);
+      bool changed = lease.db().reopen();
+      lease.reader_->generation = ++generation_;
+      return changed;
+    }
+
+    // The revision of every shard, comma separated, which tells whether two
+    // handles on the same shards see the same documents. Empty without
+    // shards.
+    static std::string Revision(const std::vector<Xapian::Database>& parts) {
+      std::string revision;
+      for (auto& part : parts) {
+        if (!revision.empty()) {
+          revision += ',';
+        }
+        revision += std::to_string(part.get_revision());
+      }
+      return revision;
+    }
+
+    // Has every reader reopened the next time it is leased.
+    void Stale() { ++generation_; }
+
+    // Number of databases, across every path, in each reader.
+    size_t size() const { return shards_.size(); }
+
+   private:
+    std::unique_ptr<Reader> Open() {
+      auto reader = std::make_unique<Reader>();
+      for (auto& shard : shards_) {
+        reader->parts.emplace_back(shard.first, shard.second);
+        reader->db.add_database(reader->parts.back());
+      }
+      reader->generation = generation_;
+      return reader;
+    }
+
+    void Release(std::unique_ptr<Reader> reader) {
+      if (reader->temporary) {
+        return;
+      }
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        idle_.push_back(std::move(reader));
+      }
+      cond_.notify_one();
+    }
+
+    const std::vector<std::pair<std::string, int>> shards_;
+    const size_t max_readers_;
+    std::atomic<uint64_t> generation_{0};
+    std::mutex mutex_;
+    std::condition_variable cond_;
+    std::vector<std::unique_ptr<Reader>> idle_;
+    size_t opened_ = 0;
+  };
+
+  SharedDatabase(const Napi::CallbackInfo& info)
+      : Napi::ObjectWrap<SharedDatabase>(info) {
+    auto env = info.Env();
+    Napi::HandleScope scope(env);
+
+    if (info[0].IsNumber()) {
+      id_ = info[0].ToNumber().Uint32Value();
+      handle_ = Attach(id_);
+      if (!handle_) {
+        throw Napi::Error::New(env, "shared database has been released");
+      }
+      return;
+    }
+
+    std::vector<std::pair<std::string, int>> shards;
+    int flags = 0;
+    if (info.Length() > 1) {
+      flags = info[1].ToNumber();
+    }
+    if (info[0].IsString()) {
+      shards.emplace_back(info[0].ToString(), flags);
+    } else if (info[0].IsArray()) {
+      auto arr = info[0].As<Napi::Array>();
+      for (uint32_t i = 0; i < arr.Length(); i++) {
+        shards.emplace_back(arr.Get(i).ToString(), flags);
+      }
+    }
+    if (shards.empty()) {
+      throw Napi::Error::New(
+          env, "first argument must be a handle, a path or array of paths");
+    }
+    handle_ = Open(env, shards, MaxReaders(info[2]), id_);
+  }
+
+  // Readers a handle opens unless {maxReaders} says otherwise; libuv's
+  // default threadpool size.
+  static constexpr size_t kDefaultReaders = 4;
+
+  static size_t MaxReaders(const Napi::Value& opts) {
+    if (!opts.IsObject() || !opts.As<Napi::Object>().Has("maxReaders")) {
+      return kDefaultReaders;
+    }
+    return opts.As<Napi::Object>().Get("maxReaders").ToNumber().Uint32Value();
+  }
+
+  // Opens `shards` as one database and registers it, setting `id`.
+  static std::shared_ptr<Handle> Open(
+      Napi::Env env, const std::vector<std::pair<std::string, int>>& shards,
+      size_t max_readers, uint32_t& id) {
+    auto handle = TRY_CATCH_XAPIAN(
+        env, std::make_shared<Handle>(shards, max_readers));
+    std::lock_guard<std::mutex> lock(registry_mutex_);
+    for (auto it = registry_.begin(); it != registry_.end();) {
+      it = it->second.expired() ? registry_.erase(it) : std::next(it);
+    }
+    id = ++next_id_;
+    registry_[id] = handle;
+    return handle;
+  }
+
+  // Returns the handle registered as `id`, or nullptr once it is released.
+  static std::shared_ptr<Handle> Attach(uint32_t id) {
+    std::lock_guard<std::mutex> lock(registry_mutex_);
+    auto it = registry_.find(id);
+    if (it == registry_.end()) {
+      return nullptr;
+    }
+    auto handle = it->second.lock();
+    if (!handle) {
+      registry_.erase(it);
+    }
+    return handle;
+  }
+
+  Napi::Value get_handle(const Napi::CallbackInfo& info) {
+    return Napi::Number::New(info.Env(), id_);
+  }
+
+  Napi::Value reopen(const Napi::CallbackInfo& info) {
+    return Napi::Boolean::New(
+        info.Env(), TRY_CATCH_XAPIAN_CALLBACK_INFO(handle_->Reopen()));
+  }
+
+  Napi::Value get_doccount(const Napi::CallbackInfo& info) {
+    auto lease = TRY_CATCH_XAPIAN_CALLBACK_INFO(handle_->Acquire(false));
+    return Napi::Number::New(
+        info.Env(), TRY_CATCH_XAPIAN_CALLBACK_INFO(lease.db().get_doccount()));
+  }
+
+  Napi::Value get_lastdocid(const Napi::CallbackInfo& info) {
+    auto lease = TRY_CATCH_XAPIAN_CALLBACK_INFO(handle_->Acquire(false));
+    return Napi::Number::New(
+        info.Env(),
+        TRY_CATCH_XAPIAN_CALLBACK_INFO(lease.db().get_lastdocid()));
+  }
+
+  Napi::Value get_avlength(const Napi::CallbackInfo& info) {
+    auto lease = TRY_CATCH_XAPIAN_CALLBACK_INFO(handle_->Acquire(false));
+    return Napi::Number::New(
+        info.Env(), TRY_CATCH_XAPIAN_CALLBACK_INFO(lease.db().get_avlength()));
+  }
+
+  Napi::Value get_revision(const Napi::CallbackInfo& info) {
+    auto lease = TRY_CATCH_XAPIAN_CALLBACK_INFO(handle_->Acquire(false));
+    return Napi::Number::New(
+        info.Env(), TRY_CATCH_XAPIAN_CALLBACK_INFO(lease.db().get_revision()));
+  }
+
+  Napi::Value get_description(const Napi::CallbackInfo& info) {
+    auto lease = TRY_CATCH_XAPIAN_CALLBACK_INFO(handle_->Acquire(false));
+    return Napi::String::New(
+        info.Env(),
+        TRY_CATCH_XAPIAN_CALLBACK_INFO(lease.db().get_description()));
+  }
+
+  Napi::Value get_data(const Napi::CallbackInfo& info) {
+    Xapian::docid docid = info[0].ToNumber();
+    auto lease = TRY_CATCH_XAPIAN_CALLBACK_INFO(handle_->Acquire(false));
+    return Napi::String::New(
+        info.Env(), TRY_CATCH_XAPIAN_CALLBACK_INFO(
+                        lease.db().get_document(docid).get_data()));
+  }
+
+  Napi::Value get_metadata(const Napi::CallbackInfo& info) {
+    std::string key = info[0].ToString();
+    auto lease = TRY_CATCH_XAPIAN_CALLBACK_INFO(handle_->Acquire(false));
+    return Napi::String::New(
+        info.Env(),
+        TRY_CATCH_XAPIAN_CALLBACK_INFO(lease.db().get_metadata(key)));
+  }
+
+  static void Init(Napi::Env env, Napi::Object exports) {
+    Napi::HandleScope scope(env);
+    Napi::Function func = DefineClass(
+        env, "SharedDatabase",
+        {
+            InstanceAccessor("handle", &SharedDatabase::get_handle, nullptr),
+            InstanceMethod("reopen", &SharedDatabase::reopen),
+            InstanceMethod("get_doccount", &SharedDatabase::get_doccount),
+            InstanceAccessor("doccount", &SharedDatabase::get_doccount,
+                             nullptr),
+            InstanceMethod("get_lastdocid", &SharedDatabase::get_lastdocid),
+            InstanceAccessor("lastdocid", &SharedDatabase::get_lastdocid,
+                             nullptr),
+            InstanceMethod("get_avlength", &SharedDatabase::get_avlength),
+            InstanceMethod("get_revision", &SharedDatabase::get_revision),
+            InstanceMethod("get_description",
+                           &SharedDatabase::get_description),
+            InstanceMethod("toString", &SharedDatabase::get_description),
+            InstanceMethod("get_data", &SharedDatabase::get_data),
+            InstanceMethod("get_metadata", &SharedDatabase::get_metadata),
+        });
+    AddonData::SetConstructor<SharedDatabase>(env, func);
+    exports.Set("SharedDatabase", func);
+  }
+
+  static bool IsSharedDatabase(const Napi::Value& value) {
+    return value.IsObject() &&
+           value.As<Napi::Object>().InstanceOf(
+               AddonData::Constructor<SharedDatabase>(value.Env()).Value());
+  }
+
+  std::shared_ptr<Handle> handle() const { return handle_; }
+
+ private:
+  // Process-wide, unlike everything else in the addon, so that handles can
+  // be looked up from any worker_thread.
+  inline static std::mutex registry_mutex_;
+  inline static uint32_t next_id_ = 0;
+  inline static std::unordered_map<uint32_t, std::weak_ptr<Handle>> registry_;
+
+  uint32_t id_ = 0;
+  std::shared_ptr<Handle> handle_;
+};
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <napi.h>
+#include <xapian.h>
+
+#include <chrono>
+
+inline double MillisecondsSince(std::chrono::steady_clock::time_point start) {
+  std::chrono::duration<double, std::milli> elapsed =
+      std::chrono::steady_clock::now() - start;
+  return elapsed.count();
+}
+
+// Timings of one query, collected when Enquire.set_stats() is on and
+// reported through MSet.stats together with the MSet's own statistics.
+struct QueryStats {
+  Xapian::Query query;
+  double parse_ms = 0;
+  double match_ms = 0;
+  double fetch_ms = 0;
+  bool cached = false;
+
+  Napi::Object ToObject(Napi::Env env, const Xapian::MSet& mset) const {
+    auto res = Napi::Object::New(env);
+    res.Set("parse_ms", parse_ms);
+    res.Set("match_ms", match_ms);
+    res.Set("fetch_ms", fetch_ms);
+    res.Set("cached", cached);
+    res.Set("matches_lower_bound", mset.get_matches_lower_bound());
+    res.Set("matches_estimated", mset.get_matches_estimated());
+    res.Set("matches_upper_bound", mset.get_matches_upper_bound());
+    res.Set("max_possible", mset.get_max_possible());
+    res.Set("max_attained", mset.get_max_attained());
+
+    auto terms = Napi::Array::New(env);
+    uint32_t i = 0;
+    for (auto it = query.get_unique_terms_begin();
+         it != query.get_unique_terms_end(); it++, i++) {
+      auto term = Napi::Object::New(env);
+      term.Set("term", *it);
+      term.Set("termfreq", mset.get_termfreq(*it));
+      term.Set("weight", mset.get_termweight(*it));
+      terms.Set(i, term);
+    }
+    res.Set("terms", terms);
+    return res;
+  }
+};
@@ -2,6 +2,7 @@
 #include <napi.h>
 #include <xapian.h>
 
+#include "addondata.hh"
 #include "exceptions.hh"
 
 class Stem : public Napi::ObjectWrap<Stem> {
@@ -33,15 +34,13 @@ class Stem : public Napi::ObjectWrap<Stem> {
             InstanceMethod("call", &Stem::call),
         });
 
-    constructor = Napi::Persistent(func);
-    constructor.SuppressDestruct();
+    AddonData::SetConstructor<Stem>(env, func);
     exports.Set("Stem", func);
   }
 
   operator const Xapian::Stem&() { return stem_; }
 
  private:
-  inline static Napi::FunctionReference constructor;
   Xapian::Stem stem_;
 };
 
@@ -2,6 +2,7 @@
 #include <napi.h>
 #include <xapian.h>
 
+#include "addondata.hh"
 #include "exceptions.hh"
 #include "stem.hh"
 #include "termiterator.hh"
@@ -161,13 +162,11 @@ class TermGenerator : public Napi::ObjectWrap<TermGenerator> {
                 Napi::Number::New(env, Xapian::TermGenerator::STOP_STEMMED)),
         });
 
-    constructor = Napi::Persistent(func);
-    constructor.SuppressDestruct();
+    AddonData::SetConstructor<TermGenerator>(env, func);
     exports.Set("TermGenerator", func);
   }
 
  private:
-  inline static Napi::FunctionReference constructor;
   Xapian::TermGenerator tg_;
   Napi::ObjectReference db_;
   Napi::ObjectReference doc_;
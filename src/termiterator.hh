@@ -2,6 +2,7 @@
 #include <napi.h>
 #include <xapian.h>
 
+#include "addondata.hh"
 #include "exceptions.hh"
 
 class TermIterator : public Napi::ObjectWrap<TermIterator> {
@@ -23,7 +24,7 @@ class TermIterator : public Napi::ObjectWrap<TermIterator> {
                           Xapian::TermIterator end) {
     auto eIt = Napi::External<decltype(it)>::New(env, &it);
     auto eEnd = Napi::External<decltype(end)>::New(env, &end);
-    return constructor.New({eIt, eEnd});
+    return AddonData::Constructor<TermIterator>(env).New({eIt, eEnd});
   }
 
   Napi::Value term(const Napi::CallbackInfo& info) {
@@ -118,15 +119,13 @@ class TermIterator : public Napi::ObjectWrap<TermIterator> {
             InstanceMethod("iter", &TermIterator::iter),
         });
 
-    constructor = Napi::Persistent(func);
-    constructor.SuppressDestruct();
+    AddonData::SetConstructor<TermIterator>(env, func);
     exports.Set("TermIterator", func);
   }
 
   operator const Xapian::TermIterator&() { return it_; }
 
  private:
-  inline static Napi::FunctionReference constructor;
   Xapian::TermIterator it_;
   Xapian::TermIterator end_;
 };
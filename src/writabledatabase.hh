@@ -3,8 +3,15 @@
 #include <napi.h>
 #include <xapian.h>
 
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "addondata.hh"
 #include "database.hh"
 #include "document.hh"
+#include "metrics.hh"
+#include "promiseworker.hh"
 
 class WritableDatabase : public Napi::ObjectWrap<WritableDatabase>,
                          public BaseDatabase<Xapian::WritableDatabase> {
@@ -33,14 +40,26 @@ class WritableDatabase : public Napi::ObjectWrap<WritableDatabase>,
 
       db_ = TRY_CATCH_XAPIAN_CALLBACK_INFO(
           Xapian::WritableDatabase(info[0].ToString(), flags));
+      // Reopened read-only by threadpool work such as compact_async().
+      shards_.emplace_back(info[0].ToString(), 0);
     }
   }
 
   void commit(const Napi::CallbackInfo& info) {
+    Metrics::Timer timer(Metrics::COMMIT);
+    std::lock_guard<std::mutex> lock(*mutex_);
     TRY_CATCH_XAPIAN_CALLBACK_INFO(db_.commit());
+    ++*generation_;
+  }
+
+  Napi::Value commit_async(const Napi::CallbackInfo& info) {
+    auto worker = new CommitWorker(info.Env(), db_, mutex_, generation_);
+    worker->Queue();
+    return worker->Promise();
   }
 
   void begin_transaction(const Napi::CallbackInfo& info) {
+    std::lock_guard<std::mutex> lock(*mutex_);
     if (info.Length() == 0) {
       TRY_CATCH_XAPIAN_CALLBACK_INFO(db_.begin_transaction());
     } else {
@@ -50,14 +69,19 @@ class WritableDatabase : public Napi::ObjectWrap<WritableDatabase>,
   }
 
   void commit_transaction(const Napi::CallbackInfo& info) {
+    std::lock_guard<std::mutex> lock(*mutex_);
     TRY_CATCH_XAPIAN_CALLBACK_INFO(db_.commit_transaction());
+    ++*generation_;
   }
 
   void cancel_transaction(const Napi::CallbackInfo& info) {
+    std::lock_guard<std::mutex> lock(*mutex_);
     TRY_CATCH_XAPIAN_CALLBACK_INFO(db_.cancel_transaction());
   }
 
   Napi::Value add_document(const Napi::CallbackInfo& info) {
+    Metrics::Timer timer(Metrics::ADD_DOCUMENT);
+    std::lock_guard<std::mutex> lock(*mutex_);
     Document* doc =
         Napi::ObjectWrap<Document>::Unwrap(info[0].As<Napi::Object>());
     Xapian::docid docid =
@@ -65,7 +89,31 @@ class WritableDatabase : public Napi::ObjectWrap<WritableDatabase>,
     return Napi::Number::New(info.Env(), docid);
   }
 
+  Napi::Value add_documents_async(const Napi::CallbackInfo& info) {
+    auto env = info.Env();
+    if (info.Length() < 1 || !info[0].IsArray()) {
+      throw Napi::Error::New(env,
+                             "first argument must be an array of documents");
+    }
+    // Deep copies, so that JS can reuse or change the Documents while the
+    // batch runs; Xapian::Document shares its internals between copies.
+    auto arr = info[0].As<Napi::Array>();
+    std::vector<Xapian::Document> docs;
+    docs.reserve(arr.Length());
+    for (uint32_t i = 0; i < arr.Length(); i++) {
+      Document* doc =
+          Napi::ObjectWrap<Document>::Unwrap(arr.Get(i).As<Napi::Object>());
+      docs.push_back(TRY_CATCH_XAPIAN_CALLBACK_INFO(Document::Detach(*doc)));
+    }
+
+    auto worker = new AddDocumentsWorker(env, db_, mutex_, std::move(docs),
+                                         CommitEvery(info[1]));
+    worker->Queue();
+    return worker->Promise();
+  }
+
   void delete_document(const Napi::CallbackInfo& info) {
+    std::lock_guard<std::mutex> lock(*mutex_);
     if (info[0].IsString()) {
       TRY_CATCH_XAPIAN_CALLBACK_INFO(db_.delete_document(info[0].ToString()));
     } else {
@@ -74,6 +122,8 @@ class WritableDatabase : public Napi::ObjectWrap<WritableDatabase>,
   }
 
   Napi::Value replace_document(const Napi::CallbackInfo& info) {
+    Metrics::Timer timer(Metrics::REPLACE_DOCUMENT);
+    std::lock_guard<std::mutex> lock(*mutex_);
     Document* doc =
         Napi::ObjectWrap<Document>::Unwrap(info[0].As<Napi::Object>());
     Xapian::docid docid;
@@ -88,6 +138,7 @@ class WritableDatabase : public Napi::ObjectWrap<WritableDatabase>,
   }
 
   void add_spelling(const Napi::CallbackInfo& info) {
+    std::lock_guard<std::mutex> lock(*mutex_);
     if (info.Length() > 1) {
       TRY_CATCH_XAPIAN_CALLBACK_INFO(
           db_.add_spelling(info[0].ToString(), info[1].ToNumber()));
@@ -97,6 +148,7 @@ class WritableDatabase : public Napi::ObjectWrap<WritableDatabase>,
   }
 
   void remove_spelling(const Napi::CallbackInfo& info) {
+    std::lock_guard<std::mutex> lock(*mutex_);
     if (info.Length() > 1) {
       TRY_CATCH_XAPIAN_CALLBACK_INFO(
           db_.remove_spelling(info[0].ToString(), info[1].ToNumber()));
@@ -106,24 +158,81 @@ class WritableDatabase : public Napi::ObjectWrap<WritableDatabase>,
   }
 
   void add_synonym(const Napi::CallbackInfo& info) {
+    std::lock_guard<std::mutex> lock(*mutex_);
     TRY_CATCH_XAPIAN_CALLBACK_INFO(
         db_.add_synonym(info[0].ToString(), info[1].ToString()));
   }
 
   void remove_synonym(const Napi::CallbackInfo& info) {
+    std::lock_guard<std::mutex> lock(*mutex_);
     TRY_CATCH_XAPIAN_CALLBACK_INFO(
         db_.remove_synonym(info[0].ToString(), info[1].ToString()));
   }
 
   void clear_synonyms(const Napi::CallbackInfo& info) {
+    std::lock_guard<std::mutex> lock(*mutex_);
     TRY_CATCH_XAPIAN_CALLBACK_INFO(db_.clear_synonyms(info[0].ToString()));
   }
 
   void set_metadata(const Napi::CallbackInfo& info) {
+    std::lock_guard<std::mutex> lock(*mutex_);
     TRY_CATCH_XAPIAN_CALLBACK_INFO(
         db_.set_metadata(info[0].ToString(), info[1].ToString()));
   }
 
+  // Reads `commitEvery` from an optional options object.
+  static Xapian::doccount CommitEvery(const Napi::Value& opts) {
+    if (!opts.IsObject() || !opts.As<Napi::Object>().Has("commitEvery")) {
+      return 0;
+    }
+    return opts.As<Napi::Object>().Get("commitEvery").ToNumber();
+  }
+
+  // Adds `count` documents built by `make_doc(i)` inside a transaction which
+  // is committed every `commit_every` documents (or once at the end when
+  // zero) and cancelled if anything throws.
+  template <class MakeDoc>
+  static std::vector<Xapian::docid> AddInTransaction(
+      Xapian::WritableDatabase& db, size_t count,
+      Xapian::doccount commit_every, MakeDoc make_doc) {
+    std::vector<Xapian::docid> docids;
+    docids.reserve(count);
+    db.begin_transaction();
+    try {
+      for (size_t i = 0; i < count; i++) {
+        const Xapian::Document& doc = make_doc(i);
+        {
+          Metrics::Timer timer(Metrics::ADD_DOCUMENT);
+          docids.push_back(db.add_document(doc));
+        }
+        if (commit_every > 0 && docids.size() % commit_every == 0) {
+          Metrics::Timer timer(Metrics::COMMIT);
+          db.commit_transaction();
+          db.begin_transaction();
+        }
+      }
+      Metrics::Timer timer(Metrics::COMMIT);
+      db.commit_transaction();
+    } catch (...) {
+      try {
+        db.cancel_transaction();
+      } catch (Xapian::Error&) {
+        // the failed call already left no transaction open
+      }
+      throw;
+    }
+    return docids;
+  }
+
+  static Napi::Array DocidsToArray(Napi::Env env,
+                                   const std::vector<Xapian::docid>& docids) {
+    auto res = Napi::Array::New(env, docids.size());
+    for (uint32_t i = 0; i < docids.size(); i++) {
+      res.Set(i, Napi::Number::New(env, docids[i]));
+    }
+    return res;
+  }
+
   static void Init(Napi::Env env, Napi::Object exports) {
     Napi::HandleScope scope(env);
     Napi::Function func = DefineClass(
@@ -138,6 +247,8 @@ class WritableDatabase : public Napi::ObjectWrap<WritableDatabase>,
             InstanceMethod("cancel_transaction",
                            &WritableDatabase::cancel_transaction),
             InstanceMethod("add_document", &WritableDatabase::add_document),
+            InstanceMethod("add_documents_async",
+                           &WritableDatabase::add_documents_async),
             InstanceMethod("delete_document",
                            &WritableDatabase::delete_document),
             InstanceMethod("replace_document",
@@ -177,16 +288,72 @@ class WritableDatabase : public Napi::ObjectWrap<WritableDatabase>,
             InstanceMethod("locked", &WritableDatabase::locked),
             InstanceMethod("get_revision", &WritableDatabase::get_revision),
             InstanceMethod("compact", &WritableDatabase::compact),
+            InstanceMethod("commit_async", &WritableDatabase::commit_async),
+            InstanceMethod("reopen_async", &WritableDatabase::reopen_async),
+            InstanceMethod("compact_async", &WritableDatabase::compact_async),
 
         });
 
-    constructor = Napi::Persistent(func);
-    constructor.SuppressDestruct();
+    AddonData::SetConstructor<WritableDatabase>(env, func);
     exports.Set("WritableDatabase", func);
   }
 
  private:
-  inline static Napi::FunctionReference constructor;
-  Xapian::WritableDatabase db_;
+  // Adds a batch of documents on the threadpool with AddInTransaction().
+  class AddDocumentsWorker : public PromiseWorker {
+   public:
+    AddDocumentsWorker(Napi::Env env, Xapian::WritableDatabase db,
+                       std::shared_ptr<std::mutex> mutex,
+                       std::vector<Xapian::Document> docs,
+                       Xapian::doccount commit_every)
+        : PromiseWorker(env),
+          db_(db),
+          mutex_(mutex),
+          docs_(std::move(docs)),
+          commit_every_(commit_every) {}
+
+   protected:
+    void Run() override {
+      std::lock_guard<std::mutex> lock(*mutex_);
+      docids_ = AddInTransaction(db_, docs_.size(), commit_every_,
+                                 [this](size_t i) { return docs_[i]; });
+    }
+
+    Napi::Value Result(Napi::Env env) override {
+      return DocidsToArray(env, docids_);
+    }
+
+   private:
+    Xapian::WritableDatabase db_;
+    std::shared_ptr<std::mutex> mutex_;
+    std::vector<Xapian::Document> docs_;
+    Xapian::doccount commit_every_;
+    std::vector<Xapian::docid> docids_;
+  };
+
+  class CommitWorker : public PromiseWorker {
+   public:
+    CommitWorker(Napi::Env env, Xapian::WritableDatabase db,
+                 std::shared_ptr<std::mutex> mutex,
+                 std::shared_ptr<uint64_t> generation)
+        : PromiseWorker(env), db_(db), mutex_(mutex), generation_(generation) {}
+
+   protected:
+    void Run() override {
+      Metrics::Timer timer(Metrics::COMMIT);
+      std::lock_guard<std::mutex> lock(*mutex_);
+      db_.commit();
+    }
+
+    Napi::Value Result(Napi::Env env) override {
+      ++*generation_;
+      return env.Undefined();
+    }
+
+   private:
+    Xapian::WritableDatabase db_;
+    std::shared_ptr<std::mutex> mutex_;
+    std::shared_ptr<uint64_t> generation_;
+  };
 };
 
@@ -1,6 +1,41 @@
 
+const fs = require('fs');
+const os = require('os');
+const path = require('path');
 const xapian = require('xapian');
 
+const tmp = fs.mkdtempSync(path.join(os.tmpdir(), 'xapian-test-'));
+let tmpCount = 0;
+
+function tmpPath() {
+  return path.join(tmp, `db${tmpCount++}`);
+}
+
+// Indexes one document per text, with docids in order, and returns the path.
+function buildDatabase(texts) {
+  const dbPath = tmpPath();
+  const db = new xapian.WritableDatabase(dbPath, xapian.DB_CREATE_OR_OVERWRITE);
+  const tg = new xapian.TermGenerator();
+  for (const text of texts) {
+    const doc = new xapian.Document();
+    doc.set_data(text);
+    tg.set_document(doc);
+    tg.index_text(text);
+    db.add_document(doc);
+  }
+  db.commit();
+  db.close();
+  return dbPath;
+}
+
+function docids(mset) {
+  return Array.from(mset, (it) => it.get_docid());
+}
+
+afterAll(() => {
+  fs.rmSync(tmp, {recursive: true, force: true});
+});
+
 test('xapian module loads', () => {
   expect(xapian).toBeDefined();
 });
@@ -18,6 +53,825 @@ test('xapian module contains objects', () => {
     'Stem',
     'Query',
     'QueryParser',
+    'Indexer',
+    'ParallelIndexer',
+    'ValueCountMatchSpy',
+    'ShardedSearcher',
+    'SharedDatabase',
   ];
   expect(Object.keys(xapian)).toEqual(expect.arrayContaining(expected));
 });
+
+test('xapian metrics snapshot', () => {
+  const metrics = xapian.metrics();
+  expect(metrics.get_mset).toEqual(
+    expect.objectContaining({count: expect.any(Number), p99_ms: expect.any(Number)}),
+  );
+});
+
+test('xapian metrics count every document added', async () => {
+  xapian.resetMetrics();
+  const db = new xapian.WritableDatabase(tmpPath(), xapian.DB_CREATE_OR_OVERWRITE);
+  db.add_document(new xapian.Document());
+  await db.add_documents_async([new xapian.Document(), new xapian.Document()]);
+  const fields = [{field: 'text', data: true}];
+  new xapian.Indexer(fields).add_records(db, [{text: 'a'}]);
+  const indexer = new xapian.ParallelIndexer(db, fields, {threads: 2});
+  await indexer.add([{text: 'b'}, {text: 'c'}]);
+  expect(await indexer.finish()).toBe(2);
+  db.commit();
+  db.close();
+
+  const metrics = xapian.metrics();
+  expect(metrics.add_document).toEqual(
+    expect.objectContaining({count: 6, errors: 0}),
+  );
+  expect(metrics.commit.count).toBeGreaterThanOrEqual(4);
+  expect(metrics.get_mset.count).toBe(0);
+});
+
+test('xapian module loads in worker threads', async () => {
+  const {Worker} = require('worker_threads');
+  const code = `
+    const xapian = require(${JSON.stringify(path.join(__dirname, '..'))});
+    const doc = new xapian.Document();
+    doc.set_data('worker');
+    require('worker_threads').parentPort.postMessage(doc.get_data());
+  `;
+  const run = () =>
+    new Promise((resolve, reject) => {
+      const worker = new Worker(code, {eval: true});
+      worker.once('message', resolve);
+      worker.once('error', reject);
+    });
+  expect(await Promise.all([run(), run()])).toEqual(['worker', 'worker']);
+});
+
+test('get_mset_async matches like get_mset', async () => {
+  const db = new xapian.Database(
+    buildDatabase(['red apple', 'green apple', 'red pear', 'apple pie']),
+  );
+  const enquire = new xapian.Enquire(db);
+  enquire.set_query(new xapian.Query('apple'));
+  const expected = docids(enquire.get_mset(0, 10));
+  expect(expected.sort()).toEqual([1, 2, 4]);
+  const msets = await Promise.all(
+    Array.from({length: 8}, () => enquire.get_mset_async(0, 10)),
+  );
+  for (const mset of msets) {
+    expect(docids(mset).sort()).toEqual(expected);
+    expect(mset.get_matches_estimated()).toBe(3);
+  }
+});
+
+test('get_mset_async readers follow the database reopening', async () => {
+  const dbPath = buildDatabase(['apple']);
+  const db = new xapian.Database(dbPath);
+  const enquire = new xapian.Enquire(db);
+  enquire.set_query(new xapian.Query('apple'));
+  expect((await enquire.get_mset_async(0, 10)).size).toBe(1);
+  const wdb = new xapian.WritableDatabase(dbPath, xapian.DB_OPEN);
+  const doc = new xapian.Document();
+  doc.add_term('apple');
+  wdb.add_document(doc);
+  wdb.commit();
+  expect((await enquire.get_mset_async(0, 10)).size).toBe(1);
+  expect(db.reopen()).toBe(true);
+  const mset = await enquire.get_mset_async(0, 10);
+  expect(docids(mset).sort()).toEqual([1, 2]);
+  wdb.close();
+});
+
+test('add_documents_async adds copies of the documents', async () => {
+  const dbPath = tmpPath();
+  const db = new xapian.WritableDatabase(dbPath, xapian.DB_CREATE_OR_OVERWRITE);
+  const doc = new xapian.Document();
+  const docs = [];
+  for (let i = 0; i < 100; i++) {
+    doc.set_data(`doc ${i}`);
+    doc.add_term(`Q${i}`);
+    docs.push(new xapian.Document());
+    docs[i].set_data(`doc ${i}`);
+  }
+  const pending = db.add_documents_async(docs, {commitEvery: 10});
+  for (const d of docs) {
+    d.set_data('changed');
+  }
+  const syncDocid = db.add_document(doc);
+  const docids = await pending;
+  expect(docids).toHaveLength(100);
+  db.commit();
+  expect(db.get_doccount()).toBe(101);
+  for (let i = 0; i < 100; i++) {
+    expect(db.get_document(docids[i]).get_data()).toBe(`doc ${i}`);
+  }
+  expect(db.get_document(syncDocid).get_data()).toBe('doc 99');
+  db.close();
+});
+
+test('fetched documents and MSets are readable during a batch', async () => {
+  const dbPath = buildDatabase(['apple pie', 'apple tart', 'plum jam']);
+  const wdb = new xapian.WritableDatabase(dbPath, xapian.DB_OPEN);
+  const doc = wdb.get_document(1);
+  const db = new xapian.Database(dbPath);
+  const enquire = new xapian.Enquire(db);
+  enquire.set_query(new xapian.Query('apple'));
+  const mset = enquire.get_mset(0, 10);
+  const docs = [];
+  for (let i = 0; i < 1000; i++) {
+    docs.push(new xapian.Document());
+    docs[i].set_data(`batch ${i}`);
+    docs[i].add_term(`Q${i}`);
+  }
+  const pending = wdb.add_documents_async(docs);
+  expect(doc.get_data()).toBe('apple pie');
+  expect(doc.get_docid()).toBe(1);
+  expect(doc.termlist_count()).toBe(2);
+  expect(mset.fetch({data: true}).map((hit) => hit.data).sort()).toEqual([
+    'apple pie',
+    'apple tart',
+  ]);
+  expect(mset.snippet('apple pie')).toContain('<b>apple</b>');
+  await pending;
+  wdb.commit();
+  expect(wdb.get_doccount()).toBe(1003);
+  wdb.close();
+  db.close();
+});
+
+test('Indexer builds documents from records', async () => {
+  const dbPath = tmpPath();
+  const db = new xapian.WritableDatabase(dbPath, xapian.DB_CREATE_OR_OVERWRITE);
+  const fields = [
+    {field: 'id', prefix: 'Q', boolean: true},
+    {field: 'title', prefix: 'S', data: true},
+    {field: 'year', valueSlot: 0, wdf: 0},
+  ];
+  const english = new xapian.Indexer(fields, {stemmer: 'english'});
+  const plain = new xapian.Indexer(fields);
+  english.add_records(db, [{id: 'a', title: 'running dogs', year: 2001}]);
+  plain.add_records(db, [{id: 'b', title: 'running cats', year: 2002}]);
+  await english.add_records_async(db, [{id: 'c', title: 'runs', year: 2003}]);
+  english.add_records(db, [{id: 'd', title: 'running', year: 2004}]);
+  db.commit();
+  db.close();
+
+  const enquire = new xapian.Enquire(new xapian.Database(dbPath));
+  enquire.set_query(new xapian.Query('ZSrun'));
+  expect(docids(enquire.get_mset(0, 10)).sort()).toEqual([1, 3, 4]);
+  enquire.set_query(new xapian.Query('Qb'));
+  const [hit] = enquire.get_mset(0, 10);
+  expect(hit.get_document().get_data()).toBe('running cats');
+  const year = hit.get_document().get_value_buffer(0);
+  expect(year.length).toBeGreaterThan(0);
+  expect(year.equals(Buffer.from('2002'))).toBe(false);
+});
+
+test('ParallelIndexer writes records in order with a small queue', async () => {
+  const dbPath = tmpPath();
+  const db = new xapian.WritableDatabase(dbPath, xapian.DB_CREATE_OR_OVERWRITE);
+  const indexer = new xapian.ParallelIndexer(
+    db,
+    [{field: 'text', data: true}],
+    {threads: 2, queueSize: 2},
+  );
+  const adds = [];
+  for (let i = 0; i < 20; i++) {
+    adds.push(indexer.add([{text: `record ${i}`}, {text: `record ${i}b`}]));
+  }
+  // The queue is full, but the threadpool is still free for other work.
+  const enquire = new xapian.Enquire(new xapian.Database(buildDatabase(['x'])));
+  enquire.set_query(new xapian.Query('x'));
+  expect(docids(await enquire.get_mset_async(0, 10))).toEqual([1]);
+  await Promise.all(adds);
+  expect(await indexer.finish()).toBe(40);
+  await expect(indexer.add([{text: 'late'}])).rejects.toThrow('already finished');
+  expect(db.get_doccount()).toBe(40);
+  expect(db.get_document(1).get_data()).toBe('record 0');
+  expect(db.get_document(4).get_data()).toBe('record 1b');
+  expect(db.get_document(40).get_data()).toBe('record 19b');
+  db.close();
+});
+
+test('MSet.toArray and columns match iteration', () => {
+  const db = new xapian.Database(
+    buildDatabase(['apple', 'apple apple', 'pear', 'apple apple apple']),
+  );
+  const enquire = new xapian.Enquire(db);
+  enquire.set_query(new xapian.Query('apple'));
+  const mset = enquire.get_mset(0, 10);
+  const iterated = Array.from(mset, (it) => ({
+    docid: it.get_docid(),
+    weight: it.get_weight(),
+  }));
+  expect(iterated).toHaveLength(3);
+
+  const hits = mset.toArray({fields: ['docid', 'weight', 'rank', 'data']});
+  expect(hits.map((hit) => hit.docid)).toEqual(iterated.map((hit) => hit.docid));
+  expect(hits.map((hit) => hit.weight)).toEqual(iterated.map((hit) => hit.weight));
+  expect(hits.map((hit) => hit.rank)).toEqual([0, 1, 2]);
+  expect(hits[0].data).toBe(db.get_document(hits[0].docid).get_data());
+  expect(mset.toArray()[0]).toEqual(
+    expect.objectContaining({docid: hits[0].docid, percent: expect.any(Number)}),
+  );
+
+  const columns = mset.columns();
+  expect(columns.docids).toBeInstanceOf(Uint32Array);
+  expect(Array.from(columns.docids)).toEqual(iterated.map((hit) => hit.docid));
+  expect(Array.from(columns.weights)).toEqual(iterated.map((hit) => hit.weight));
+  expect(columns.percents).toHaveLength(3);
+});
+
+test('MSet.fetch returns data and values, as Buffers on request', () => {
+  const dbPath = tmpPath();
+  const wdb = new xapian.WritableDatabase(dbPath, xapian.DB_CREATE_OR_OVERWRITE);
+  const indexer = new xapian.Indexer([
+    {field: 'title', data: true},
+    {field: 'price', valueSlot: 0, wdf: 0},
+    {field: 'colour', valueSlot: 1, boolean: true, prefix: 'XC'},
+  ]);
+  indexer.add_records(wdb, [
+    {title: 'first', price: 12.5, colour: 'red'},
+    {title: 'second', price: 1000, colour: 'blue'},
+  ]);
+  wdb.commit();
+  wdb.close();
+
+  const db = new xapian.Database(dbPath);
+  const enquire = new xapian.Enquire(db);
+  enquire.set_query(
+    new xapian.Query(xapian.Query.OP_OR, [
+      new xapian.Query('XCred'),
+      new xapian.Query('XCblue'),
+    ]),
+  );
+  const mset = enquire.get_mset(0, 10);
+  const hits = mset.fetch({data: true, values: [1, 0]});
+  expect(hits.map((hit) => hit.docid).sort()).toEqual([1, 2]);
+  for (const hit of hits) {
+    const doc = db.get_document(hit.docid);
+    expect(hit.data).toBe(doc.get_data());
+    expect(hit.values[0]).toBe(doc.get_value(1));
+  }
+
+  const buffers = mset.fetch({data: true, values: [0], buffers: true});
+  for (const hit of buffers) {
+    const doc = db.get_document(hit.docid);
+    expect(Buffer.isBuffer(hit.data)).toBe(true);
+    expect(hit.data.toString()).toBe(doc.get_data());
+    expect(hit.values[0].equals(doc.get_value_buffer(0))).toBe(true);
+  }
+});
+
+test('Document stores binary data and values byte for byte', () => {
+  const bytes = [0, 255, 128, 10, 0];
+  const doc = new xapian.Document();
+  doc.set_data(Buffer.from(bytes));
+  expect(Array.from(doc.get_data_buffer())).toEqual(bytes);
+  doc.set_data(Uint8Array.from(bytes).buffer);
+  expect(Array.from(doc.get_data_buffer())).toEqual(bytes);
+  doc.add_value(0, new Uint8Array(Uint8Array.from([7, ...bytes]).buffer, 1));
+  expect(Array.from(doc.get_value_buffer(0))).toEqual(bytes);
+  doc.add_value(1, new DataView(Uint8Array.from(bytes).buffer, 1, 2));
+  expect(Array.from(doc.get_value_buffer(1))).toEqual([255, 128]);
+  doc.add_value(2, 'text');
+  expect(doc.get_value(2)).toBe('text');
+  doc.add_value(3, 42);
+  expect(doc.get_value(3)).toBe('42');
+});
+
+test('Enquire result cache hits until the database is reopened', async () => {
+  const dbPath = buildDatabase(['apple', 'apple pear']);
+  const db = new xapian.Database(dbPath);
+  const enquire = new xapian.Enquire(db);
+  enquire.set_stats();
+  enquire.set_result_cache({maxEntries: 10});
+  enquire.set_query(new xapian.Query('apple'));
+
+  expect(enquire.get_mset(0, 10).stats.cached).toBe(false);
+  const cached = enquire.get_mset(0, 10);
+  expect(cached.stats.cached).toBe(true);
+  expect(docids(cached).sort()).toEqual([1, 2]);
+  expect((await enquire.get_mset_async(0, 10)).stats.cached).toBe(true);
+  expect(enquire.get_mset(0, 5).stats.cached).toBe(false);
+  expect(enquire.get_result_cache_stats()).toEqual(
+    expect.objectContaining({hits: 2, misses: 2, entries: 2, maxEntries: 10}),
+  );
+
+  const wdb = new xapian.WritableDatabase(dbPath, xapian.DB_OPEN);
+  const doc = new xapian.Document();
+  doc.add_term('apple');
+  wdb.add_document(doc);
+  wdb.commit();
+  wdb.close();
+  expect(db.reopen()).toBe(true);
+  const fresh = enquire.get_mset(0, 10);
+  expect(fresh.stats.cached).toBe(false);
+  expect(docids(fresh).sort()).toEqual([1, 2, 3]);
+
+  enquire.set_result_cache(false);
+  enquire.get_mset(0, 10);
+  expect(enquire.get_result_cache_stats().entries).toBe(0);
+});
+
+test('Enquire result cache keeps the revision each result saw', async () => {
+  const dbPath = buildDatabase(['apple']);
+  const db = new xapian.Database(dbPath);
+  const wdb = new xapian.WritableDatabase(dbPath, xapian.DB_OPEN);
+  const doc = new xapian.Document();
+  doc.add_term('apple');
+  wdb.add_document(doc);
+  wdb.commit();
+  const enquire = new xapian.Enquire(db);
+  enquire.set_stats();
+  enquire.set_result_cache({maxEntries: 10});
+  enquire.set_query(new xapian.Query('apple'));
+
+  // The async match opens its reader at the newer revision, which db
+  // doesn't see until it is reopened.
+  expect(docids(await enquire.get_mset_async(0, 10)).sort()).toEqual([1, 2]);
+  const old = enquire.get_mset(0, 10);
+  expect(old.stats.cached).toBe(false);
+  expect(docids(old)).toEqual([1]);
+  expect(db.reopen()).toBe(true);
+  const cached = enquire.get_mset(0, 10);
+  expect(cached.stats.cached).toBe(true);
+  expect(docids(cached).sort()).toEqual([1, 2]);
+  wdb.close();
+});
+
+test('QueryParser caches parsed queries', () => {
+  const qp = new xapian.QueryParser();
+  qp.set_cache({maxEntries: 10});
+  const first = qp.parse_query('title:apple pie');
+  expect(qp.parse_query('title:apple pie').get_description()).toBe(
+    first.get_description(),
+  );
+  // 7 is FLAG_DEFAULT; only the default prefix differs.
+  qp.parse_query('title:apple pie', 7, 'X');
+  expect(qp.get_cache_stats()).toEqual(
+    expect.objectContaining({hits: 1, misses: 2, entries: 2}),
+  );
+
+  // Changing how queries parse drops what was cached.
+  qp.add_prefix('title', 'S');
+  const prefixed = qp.parse_query('title:apple pie');
+  expect(prefixed.get_description()).not.toBe(first.get_description());
+  expect(prefixed.get_description()).toContain('Sapple');
+  expect(qp.get_cache_stats().entries).toBe(1);
+});
+
+test('Query builds trees, value ranges and round-trips serialisation', () => {
+  const dbPath = tmpPath();
+  const wdb = new xapian.WritableDatabase(dbPath, xapian.DB_CREATE_OR_OVERWRITE);
+  new xapian.Indexer([
+    {field: 'text'},
+    {field: 'year', valueSlot: 0, wdf: 0},
+  ]).add_records(wdb, [
+    {text: 'apple', year: 1999},
+    {text: 'apple pear', year: 2005},
+    {text: 'pear', year: 2010},
+  ]);
+  wdb.commit();
+  wdb.close();
+  const enquire = new xapian.Enquire(new xapian.Database(dbPath));
+  const match = (query) => {
+    enquire.set_query(query);
+    return docids(enquire.get_mset(0, 10)).sort();
+  };
+
+  expect(match(new xapian.Query(xapian.Query.OP_AND, ['apple', 'pear']))).toEqual([2]);
+  expect(
+    match(new xapian.Query(xapian.Query.OP_OR, [new xapian.Query('apple'), 'pear'])),
+  ).toEqual([1, 2, 3]);
+  expect(match(xapian.Query.valueRange(0, 2000, 2010))).toEqual([2, 3]);
+  expect(match(new xapian.Query(xapian.Query.OP_VALUE_LE, 0, 2005))).toEqual([1, 2]);
+  expect(match(xapian.Query.matchAll)).toEqual([1, 2, 3]);
+  expect(match(new xapian.Query())).toEqual([]);
+
+  const query = new xapian.Query(xapian.Query.OP_AND, [
+    'apple',
+    xapian.Query.valueRange(0, 2000, 2010),
+  ]);
+  expect(match(query)).toEqual([2]);
+  const copy = xapian.Query.unserialise(query.serialise_buffer());
+  expect(copy.get_description()).toBe(query.get_description());
+  expect(match(copy)).toEqual([2]);
+  expect(copy.get_length()).toBe(query.get_length());
+});
+
+test('Enquire sorts by value and by several keys', async () => {
+  const dbPath = tmpPath();
+  const wdb = new xapian.WritableDatabase(dbPath, xapian.DB_CREATE_OR_OVERWRITE);
+  new xapian.Indexer([
+    {field: 'text'},
+    {field: 'year', valueSlot: 0, wdf: 0},
+    {field: 'kind', valueSlot: 1, wdf: 0},
+  ]).add_records(wdb, [
+    {text: 'item', year: 2010, kind: 'b'},
+    {text: 'item', year: 1999, kind: 'a'},
+    {text: 'item', year: 2005, kind: 'b'},
+    {text: 'item', year: 2001, kind: 'a'},
+  ]);
+  wdb.commit();
+  wdb.close();
+  const enquire = new xapian.Enquire(new xapian.Database(dbPath));
+  enquire.set_query(new xapian.Query('item'));
+
+  enquire.set_sort_by_value(0);
+  expect(docids(enquire.get_mset(0, 10))).toEqual([2, 4, 3, 1]);
+  enquire.set_sort_by_value(0, true);
+  expect(docids(enquire.get_mset(0, 10))).toEqual([1, 3, 4, 2]);
+  expect(docids(await enquire.get_mset_async(0, 10))).toEqual([1, 3, 4, 2]);
+
+  enquire.set_sort_by_key([{slot: 1}, {slot: 0, reverse: true}]);
+  expect(docids(enquire.get_mset(0, 10))).toEqual([4, 2, 1, 3]);
+  expect(docids(await enquire.get_mset_async(0, 10))).toEqual([4, 2, 1, 3]);
+  expect(() => enquire.set_sort_by_key(1)).toThrow('sort keys must be an array');
+
+  enquire.set_sort_by_relevance();
+  expect(docids(enquire.get_mset(0, 10)).sort()).toEqual([1, 2, 3, 4]);
+});
+
+test('Enquire collapses hits on a value slot', async () => {
+  const dbPath = tmpPath();
+  const wdb = new xapian.WritableDatabase(dbPath, xapian.DB_CREATE_OR_OVERWRITE);
+  new xapian.Indexer([
+    {field: 'text'},
+    {field: 'site', valueSlot: 0, wdf: 0},
+  ]).add_records(wdb, ['a', 'a', 'b', 'a', 'c'].map((site) => ({text: 'page', site})));
+  wdb.commit();
+  wdb.close();
+  const enquire = new xapian.Enquire(new xapian.Database(dbPath));
+  enquire.set_query(new xapian.Query('page'));
+
+  enquire.set_collapse_key(0);
+  const hits = enquire
+    .get_mset(0, 10, 10)
+    .toArray({fields: ['docid', 'collapse_key', 'collapse_count']});
+  expect(hits.map((hit) => hit.collapse_key).sort()).toEqual(['a', 'b', 'c']);
+  expect(hits.reduce((sum, hit) => sum + hit.collapse_count, hits.length)).toBe(5);
+  expect((await enquire.get_mset_async(0, 10, 10)).size).toBe(3);
+
+  enquire.set_collapse_key(0, 2);
+  expect(enquire.get_mset(0, 10).size).toBe(4);
+  enquire.set_collapse_key(xapian.BAD_VALUENO);
+  expect(enquire.get_mset(0, 10).size).toBe(5);
+});
+
+test('MSet.get_facets counts each match on its own', async () => {
+  const dbPath = tmpPath();
+  const wdb = new xapian.WritableDatabase(dbPath, xapian.DB_CREATE_OR_OVERWRITE);
+  new xapian.Indexer([
+    {field: 'text'},
+    {field: 'colour', valueSlot: 0, wdf: 0},
+    {field: 'size', valueSlot: 1, wdf: 0},
+  ]).add_records(wdb, [
+    {text: 'shirt', colour: 'red', size: 1},
+    {text: 'shirt', colour: 'blue', size: 2},
+    {text: 'shirt hat', colour: 'red', size: 2},
+    {text: 'hat', colour: 'green', size: 3},
+  ]);
+  wdb.commit();
+  wdb.close();
+  const enquire = new xapian.Enquire(new xapian.Database(dbPath));
+  const colours = new xapian.ValueCountMatchSpy(0);
+  enquire.add_matchspy(colours);
+  enquire.add_matchspy(new xapian.ValueCountMatchSpy(1));
+
+  enquire.set_query(new xapian.Query('shirt'));
+  const shirts = enquire.get_mset(0, 10, 10);
+  enquire.set_query(new xapian.Query('hat'));
+  const hats = enquire.get_mset(0, 10, 10);
+  expect(shirts.get_facets()[0]).toEqual({
+    total: 3,
+    values: [
+      {value: 'red', frequency: 2},
+      {value: 'blue', frequency: 1},
+    ],
+  });
+  expect(hats.get_facets()[0].total).toBe(2);
+  expect(colours.get_total()).toBe(2);
+
+  const [a, b] = await Promise.all([
+    enquire.get_mset_async(0, 10, 10),
+    enquire.get_mset_async(0, 10, 10),
+  ]);
+  expect(a.get_facets()).toEqual(hats.get_facets());
+  expect(b.get_facets()).toEqual(hats.get_facets());
+
+  const sizes = hats.get_facets(0, {buffers: true})[1].values;
+  expect(sizes.map((v) => v.frequency)).toEqual([1, 1]);
+  expect(Buffer.isBuffer(sizes[0].value)).toBe(true);
+  expect(Buffer.compare(sizes[0].value, sizes[1].value)).toBe(-1);
+
+  enquire.clear_matchspies();
+  expect(enquire.get_mset(0, 10).get_facets()).toEqual({});
+});
+
+test('get_mset_async rejects with an AbortError when aborted', async () => {
+  const enquire = new xapian.Enquire(
+    new xapian.Database(buildDatabase(['apple', 'apple pear'])),
+  );
+  enquire.set_query(new xapian.Query('apple'));
+  enquire.set_result_cache({maxEntries: 10});
+  await enquire.get_mset_async(0, 10);
+
+  // An aborted signal wins over a cached result.
+  const aborted = new AbortController();
+  aborted.abort();
+  await expect(
+    enquire.get_mset_async(0, 10, 0, {signal: aborted.signal}),
+  ).rejects.toMatchObject({name: 'AbortError'});
+
+  enquire.set_result_cache(false);
+  const controller = new AbortController();
+  const pending = enquire.get_mset_async(0, 10, 0, {signal: controller.signal});
+  controller.abort();
+  await expect(pending).rejects.toMatchObject({name: 'AbortError'});
+
+  // The listener is removed once the match completes.
+  const signal = {
+    aborted: false,
+    addEventListener: jest.fn(),
+    removeEventListener: jest.fn(),
+  };
+  expect((await enquire.get_mset_async(0, 10, 0, {signal})).size).toBe(2);
+  expect(signal.addEventListener).toHaveBeenCalledTimes(1);
+  const [type, listener] = signal.addEventListener.mock.calls[0];
+  expect(signal.removeEventListener).toHaveBeenCalledWith(type, listener);
+});
+
+test('set_time_limit marks overrunning matches as truncated', async () => {
+  const enquire = new xapian.Enquire(
+    new xapian.Database(buildDatabase(['apple', 'apple pear'])),
+  );
+  enquire.set_query(new xapian.Query('apple'));
+  expect(enquire.get_mset(0, 10).truncated).toBe(false);
+  enquire.set_time_limit(1e-9);
+  expect(enquire.get_mset(0, 10).truncated).toBe(true);
+  expect((await enquire.get_mset_async(0, 10)).truncated).toBe(true);
+  enquire.set_time_limit(0);
+  expect(enquire.get_mset(0, 10).truncated).toBe(false);
+});
+
+test('Enquire and QueryParser see shards added to their database', async () => {
+  const db = new xapian.Database(buildDatabase(['apple', 'pear']));
+  const enquire = new xapian.Enquire(db);
+  const qp = new xapian.QueryParser();
+  qp.set_database(db);
+  enquire.set_query(qp.parse_query('apple'));
+  expect(docids(enquire.get_mset(0, 10))).toEqual([1]);
+
+  db.add_database(buildDatabase(['apple pie', 'plum']));
+  enquire.set_query(qp.parse_query('apple'));
+  // Docids interleave: shard 1 has 1 and 3, shard 2 has 2 and 4.
+  expect(docids(enquire.get_mset(0, 10)).sort()).toEqual([1, 2]);
+  expect(docids(await enquire.get_mset_async(0, 10)).sort()).toEqual([1, 2]);
+});
+
+test('ShardedSearcher numbers hits like one Database', async () => {
+  const paths = [
+    buildDatabase(['apple one', 'pear', 'apple two']),
+    buildDatabase(['apple three']),
+    buildDatabase(['plum', 'apple four', 'apple five']),
+  ];
+  // The first shard holds two databases.
+  const pair = new xapian.Database(paths[0]);
+  pair.add_database(paths[1]);
+  const searcher = new xapian.ShardedSearcher([pair, paths[2]]);
+  expect(searcher.shard_count).toBe(2);
+
+  const all = new xapian.Database(paths[0]);
+  all.add_database(paths[1]);
+  all.add_database(paths[2]);
+  const res = await searcher.search(new xapian.Query('apple'), 0, 10, {
+    data: true,
+  });
+  expect(res.hits).toHaveLength(5);
+  for (const hit of res.hits) {
+    expect(all.get_document(hit.docid).get_data()).toBe(hit.data);
+  }
+  expect(res.hits.map((hit) => hit.docid).sort((a, b) => a - b)).toEqual([
+    1, 2, 6, 7, 9,
+  ]);
+
+  expect(() => new xapian.ShardedSearcher([{}])).toThrow(TypeError);
+  expect(() => new xapian.ShardedSearcher([new xapian.Document()])).toThrow(
+    TypeError,
+  );
+});
+
+test('SharedDatabase serves concurrent searches and reopens every handle', async () => {
+  const dbPath = buildDatabase(['apple', 'pear']);
+  const shared = new xapian.SharedDatabase(dbPath);
+  const attached = new xapian.SharedDatabase(shared.handle);
+  expect(attached.doccount).toBe(2);
+  expect(attached.get_data(1)).toBe('apple');
+
+  const searcher = new xapian.ShardedSearcher([shared]);
+  const search = () =>
+    Promise.all(
+      Array.from({length: 16}, () =>
+        searcher.search(new xapian.Query('apple'), 0, 10),
+      ),
+    );
+  for (const res of await search()) {
+    expect(res.hits.map((hit) => hit.docid)).toEqual([1]);
+  }
+
+  const wdb = new xapian.WritableDatabase(dbPath, xapian.DB_OPEN);
+  const doc = new xapian.Document();
+  doc.add_term('apple');
+  wdb.add_document(doc);
+  wdb.commit();
+  wdb.close();
+  expect(attached.reopen()).toBe(true);
+  expect(shared.doccount).toBe(3);
+  // Handles opened for the earlier searches catch up too.
+  for (const res of await search()) {
+    expect(res.hits.map((hit) => hit.docid).sort()).toEqual([1, 3]);
+  }
+
+  // With every handle busy, calls on the main thread still don't wait.
+  const single = new xapian.SharedDatabase(dbPath, 0, {maxReaders: 1});
+  const busy = new xapian.ShardedSearcher([single]);
+  const pending = Promise.all(
+    Array.from({length: 8}, () => busy.search('apple', 0, 10)),
+  );
+  expect(single.doccount).toBe(3);
+  expect(single.get_data(1)).toBe('apple');
+  expect(await pending).toHaveLength(8);
+});
+
+test('commit_async, reopen_async and compact_async', async () => {
+  const dbPath = buildDatabase(['apple', 'pear']);
+  const reader = new xapian.Database(dbPath);
+  const wdb = new xapian.WritableDatabase(dbPath, xapian.DB_OPEN);
+  const doc = new xapian.Document();
+  doc.add_term('apple');
+  wdb.add_document(doc);
+  // Documents and MSets read before stay usable while these run.
+  const enquire = new xapian.Enquire(reader);
+  enquire.set_query(new xapian.Query('apple'));
+  const mset = enquire.get_mset(0, 10);
+  const first = wdb.get_document(1);
+  const committing = wdb.commit_async();
+  expect(first.get_data()).toBe('apple');
+  expect(mset.fetch({data: true})).toEqual([{docid: 1, data: 'apple'}]);
+  await committing;
+  const reopening = reader.reopen_async();
+  expect(Array.from(mset, (hit) => hit.document.get_data())).toEqual([
+    'apple',
+  ]);
+  expect(await reopening).toBe(true);
+  expect(reader.doccount).toBe(3);
+  expect(await reader.reopen_async()).toBe(false);
+
+  const compacted = tmpPath();
+  const events = [];
+  const pending = reader.compact_async(compacted, 0, 0, (event) =>
+    events.push(event),
+  );
+  // The database stays usable while it is compacted.
+  expect(reader.get_document(1).get_data()).toBe('apple');
+  await pending;
+  const count = events.length;
+  expect(count).toBeGreaterThan(0);
+  expect(events[0]).toEqual({
+    table: expect.any(String),
+    status: expect.any(String),
+  });
+  await new Promise((resolve) => setTimeout(resolve, 50));
+  expect(events).toHaveLength(count);
+  expect(new xapian.Database(compacted).doccount).toBe(3);
+
+  // A writable database is compacted as last committed.
+  wdb.add_document(doc);
+  const fromWriter = tmpPath();
+  await wdb.compact_async(fromWriter);
+  expect(new xapian.Database(fromWriter).doccount).toBe(3);
+  wdb.close();
+});
+
+test('watch reopens the database when it changes', async () => {
+  const dbPath = buildDatabase(['apple']);
+  const db = new xapian.Database(dbPath);
+  const revision = new Promise((resolve) => db.watch(resolve, {interval: 10}));
+  const wdb = new xapian.WritableDatabase(dbPath, xapian.DB_OPEN);
+  wdb.add_document(new xapian.Document());
+  wdb.commit();
+  wdb.close();
+  expect(await revision).toBe(2);
+  expect(db.doccount).toBe(2);
+  db.unwatch();
+});
+
+test('MSet.stats reports per-query timings and term statistics', async () => {
+  const enquire = new xapian.Enquire(
+    new xapian.Database(buildDatabase(['apple', 'apple pear', 'pear'])),
+  );
+  const qp = new xapian.QueryParser();
+  enquire.set_query(qp.parse_query('apple'));
+  expect(enquire.get_mset(0, 10).stats).toBeUndefined();
+
+  enquire.set_stats();
+  const msets = [enquire.get_mset(0, 10), await enquire.get_mset_async(0, 10)];
+  for (const mset of msets) {
+    const {stats} = mset;
+    expect(stats.cached).toBe(false);
+    expect(stats.parse_ms).toBeGreaterThanOrEqual(0);
+    expect(stats.match_ms).toBeGreaterThanOrEqual(0);
+    expect(stats.matches_estimated).toBe(2);
+    expect(stats.terms).toEqual([
+      {term: 'apple', termfreq: 2, weight: expect.any(Number)},
+    ]);
+    expect(stats.fetch_ms).toBe(0);
+    mset.toArray();
+    expect(mset.stats.fetch_ms).toBeGreaterThanOrEqual(0);
+  }
+});
+
+test('Enquire.set_weighting_scheme changes how hits are weighed', async () => {
+  const enquire = new xapian.Enquire(
+    new xapian.Database(buildDatabase(['apple', 'apple apple pear', 'pear'])),
+  );
+  const weights = (mset) => Array.from(mset, (it) => it.get_weight());
+  enquire.set_query(new xapian.Query(xapian.Query.OP_OR, ['apple', 'pear']));
+
+  enquire.set_weighting_scheme('CoordWeight');
+  const coord = enquire.get_mset(0, 10);
+  expect(docids(coord)[0]).toBe(2);
+  expect(weights(coord)).toEqual([2, 1, 1]);
+
+  enquire.set_weighting_scheme('BoolWeight');
+  const bool = await enquire.get_mset_async(0, 10);
+  expect(docids(bool)).toEqual([1, 2, 3]);
+  expect(weights(bool)).toEqual([0, 0, 0]);
+
+  enquire.set_query(new xapian.Query('apple'));
+  enquire.set_weighting_scheme('TfIdfWeight', {normalizations: 'ntn'});
+  const tfidf = enquire.get_mset(0, 10);
+  expect(docids(tfidf)).toEqual([2, 1]);
+  expect(weights(tfidf)[0]).toBeCloseTo(2 * weights(tfidf)[1]);
+
+  enquire.set_weighting_scheme('BM25PlusWeight', {delta: 1});
+  expect(weights(enquire.get_mset(0, 10)).every((w) => w > 0)).toBe(true);
+  expect(() => enquire.set_weighting_scheme('NoSuchWeight')).toThrow(
+    'unknown weighting scheme NoSuchWeight',
+  );
+});
+
+test('posting sources weigh documents by their values', async () => {
+  const dbPath = tmpPath();
+  const wdb = new xapian.WritableDatabase(dbPath, xapian.DB_CREATE_OR_OVERWRITE);
+  new xapian.Indexer([
+    {field: 'text'},
+    {field: 'rank', valueSlot: 0, wdf: 0},
+    {field: 'tier', valueSlot: 1, wdf: 0},
+  ]).add_records(wdb, [
+    {text: 'apple', rank: 4, tier: 'gold'},
+    {text: 'apple', rank: 3, tier: 'silver'},
+    {text: 'apple', rank: 2},
+    {text: 'pear', rank: 1, tier: 'gold'},
+  ]);
+  wdb.close();
+  const enquire = new xapian.Enquire(new xapian.Database(dbPath));
+  const match = async (query) => {
+    enquire.set_query(query);
+    const mset = enquire.get_mset(0, 10);
+    // Posting sources survive the copy made for the threadpool.
+    expect(docids(await enquire.get_mset_async(0, 10))).toEqual(docids(mset));
+    return Array.from(mset, (it) => [it.get_docid(), it.get_weight()]);
+  };
+
+  expect(await match(xapian.Query.valueWeightPostingSource(0))).toEqual([
+    [1, 4],
+    [2, 3],
+    [3, 2],
+    [4, 1],
+  ]);
+  expect(
+    await match(xapian.Query.decreasingValueWeightPostingSource(0)),
+  ).toEqual([
+    [1, 4],
+    [2, 3],
+    [3, 2],
+    [4, 1],
+  ]);
+  expect(
+    await match(xapian.Query.valueMapPostingSource(1, {gold: 2, silver: 1})),
+  ).toEqual([
+    [1, 2],
+    [4, 2],
+    [2, 1],
+  ]);
+
+  const boosted = await match(
+    new xapian.Query(xapian.Query.OP_AND_MAYBE, [
+      'apple',
+      xapian.Query.valueWeightPostingSource(0),
+    ]),
+  );
+  expect(boosted.map(([docid]) => docid)).toEqual([1, 2, 3]);
+});